@@ -22,12 +22,30 @@
 #include <linux/cdev.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/list.h>
+#include <linux/seqlock.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/filter.h>
+#include <linux/file.h>
 #include <asm/uaccess.h>
+#include <asm/ioctls.h>
 #ifdef DEV_MKNOD
 #  include <linux/device.h>
 #  include <linux/device/class.h>
 #endif /* DEV_MKNOD */
 
+#include "fanout.h"
+
+#define CREATE_TRACE_POINTS
+#include "fanout_trace.h"
+
 
 /* Limits and other defines */
 /* The # fanout devices.  Max minor # is one less than this */
@@ -38,9 +56,179 @@
 #endif /* DEV_MKNOD */
 #define DEVNAME "fanout"
 #define DEBUGLEVEL (2)
+/* Each commit is stamped in a small log so that a read can tell how
+ * long ago its first byte was published.  Latencies are kept in log2
+ * buckets: bucket n counts delays in [2^(n-1), 2^n) nanoseconds. */
+#define FO_CLOG_SIZE (256)	/* commits remembered, a power of 2 */
+#define FO_LAT_BUCKETS (40)	/* 2^39 ns is about 9 minutes */
+#define FO_LAT_WOKEN (0)	/* reader slept waiting for the data */
+#define FO_LAT_READY (1)	/* data was waiting for the reader */
+#define FO_LAT_NTYPES (2)
+
+/* A transaction stages its records in room that starts this big and
+ * doubles as they are added, up to half of buffersize */
+#define FO_TX_MIN (512)
 
 
 /* Data structure definitions */
+/* One entry in the commit time log */
+struct fo_commit {
+	loff_t end;		/* stream offset just past this write */
+	u64 ns;			/* ktime_get_ns() at commit */
+};
+
+/* A framed topic keeps this header in the buffer in front of
+ * every record.  dev->tail is always at a header. */
+struct fo_rhdr {
+	u32 len;		/* payload bytes that follow */
+	u16 flags;		/* FO_REC_* */
+	u8 tag;			/* set by the publisher, FO_IOC_SETTAG */
+	u8 pad;
+	u64 seq;		/* record number in this topic, from 0 */
+	u64 ns;			/* ktime_get_ns() when written */
+	u64 gseq;		/* from fo_gseq, or 0 */
+};
+#define FO_RHDR_SIZE ((int) sizeof(struct fo_rhdr))
+
+/* Every indexstride'th record of a framed topic is noted in a small
+ * ring so that seeks by offset, sequence or time are a binary search
+ * plus a short walk instead of a walk from the tail */
+struct fo_idx {
+	loff_t off;		/* stream offset of the record header */
+	u64 seq;		/* its sequence number */
+	u64 ns;			/* and its time */
+};
+
+/* Urgent records of a framed device go in a small ring of fixed
+ * slots beside the main buffer, so they never queue behind bulk
+ * data.  Readers drain it before the main buffer. */
+#define FO_PRIO_SLOTS (16)	/* urgent records kept, a power of 2,
+				 * plus one to stage a new one in */
+#define FO_PRIO_MAX (256)	/* largest urgent record */
+
+struct fo_pslot {
+	struct fo_rhdr h;	/* header, FO_REC_PRIO set */
+	char data[FO_PRIO_MAX];	/* the record */
+};
+
+/* A framed device may keep the newest record for each key, the key
+ * being the first keylen bytes of a record.  A new reader can ask
+ * for a snapshot of the cache before the live records. */
+#define FO_KC_BITS (10)		/* log2 of hash buckets */
+#define FO_MAXKEY (64)		/* longest key */
+
+struct fo_kent {
+	struct hlist_node node;	/* in fo_kcache.hash */
+	struct list_head lru;	/* in fo_kcache.lru, oldest update first */
+	u32 hash;		/* jhash of the key */
+	int size;		/* room in data, what the allocation
+				 * has past the header */
+	struct fo_rhdr h;	/* header of the record */
+	char data[];		/* the record, key first */
+};
+
+/* Memory a cache entry takes, all of its kmalloc() size class */
+#define FO_KENT_BYTES(ent)	(sizeof(struct fo_kent) + (ent)->size)
+
+struct fo_kcache {
+	int keylen;		/* bytes of key at the start of a record */
+	int maxbytes;		/* most memory the entries may take */
+	int bytes;		/* memory the entries take now, see
+				 * FO_KENT_BYTES() */
+	int nkeys;		/* number of keys kept now */
+	struct list_head lru;	/* all fo_kents, oldest update first */
+	struct fo_kent *spare;	/* an evicted entry kept for reuse */
+	DECLARE_HASHTABLE(hash, FO_KC_BITS);
+};
+
+/* Readers in a consumer group share one cursor, and each record
+ * at it goes to just one member.  A round robin group wakes one
+ * idle member per record; a keyed group gives the record to the
+ * member picked by the hash of its key.  Groups last until the
+ * device mode changes so that members can come and go. */
+#define FO_MAXGROUPS (16)	/* groups per device */
+
+struct fo_reader;
+
+struct fo_group {
+	struct list_head list;	/* on dev->groups */
+	char name[FO_GROUPNAME];	/* as given to FO_IOC_JOIN */
+	int keylen;		/* bytes of key to hash, 0 for round robin */
+	loff_t pos;		/* the shared cursor, at a record */
+	u64 lost;		/* bytes overrun at the cursor */
+	int nmembers;		/* number of members */
+	int nwait;		/* members asleep in fo_read_group() */
+	u32 nextid;		/* id for the next member to join */
+	struct list_head members;	/* fo_readers, in member order */
+	struct fo_reader *owner;	/* keyed: who gets the record at pos */
+	wait_queue_head_t wq;	/* round robin members wait here */
+};
+
+/* Topics may be given hierarchical names like md/equities/XNYS on
+ * the control device.  The names are kept in a trie with one node
+ * per level so that wildcard subscriptions expand by walking it. */
+struct fo_tnode {
+	struct list_head sibs;	/* on parent->kids */
+	struct list_head kids;	/* the next levels down */
+	struct fo_tnode *parent;	/* NULL at the root */
+	int minor;		/* topic with this full name, or -1 */
+	char name[];		/* this level */
+};
+
+struct fo_sub;
+
+/* One topic in a subscription on the control device */
+struct fo_subt {
+	struct list_head snode;	/* on sub->topics, under sub->lock */
+	struct list_head dnode;	/* on dev->subs, under dev->sem */
+	struct fo_sub *sub;	/* the subscription */
+	struct fo *dev;		/* the topic */
+	loff_t pos;		/* next record to read, under dev->sem */
+	u64 key;		/* merge key of the record at pos, its gseq
+				 * if globalseq is on, else its time, or
+				 * U64_MAX if none */
+	int stale;		/* key needs a new peek, set under dev->sem
+				 * by writers before they take a gseq */
+};
+
+/* A pattern a subscription was made with, matched again against
+ * every topic named later */
+struct fo_pat {
+	struct list_head list;	/* on sub->pats */
+	char pat[];		/* levels, or * or a final ** */
+};
+
+/* A subscription to many topics on one file, the private data of
+ * an open control device */
+struct fo_sub {
+	struct mutex lock;	/* topics and pats */
+	struct list_head topics;	/* fo_subts, next to read first */
+	struct list_head pats;	/* fo_pats */
+	struct list_head list;	/* on fo_subs once it has a pattern */
+	int ready;		/* a topic got a record since we looked */
+	wait_queue_head_t wq;	/* readers of the subscription wait here */
+	u64 bytes;		/* bytes read */
+	u64 lost;		/* bytes overrun in all topics */
+	unsigned int flags;	/* FO_SF_* */
+	int ntopics;		/* length of topics */
+};
+
+/* One ring of a striped device.  Its writers hold lock; readers
+ * take nothing, and check tail after copying a record out to see if
+ * a writer wrapped over it meanwhile. */
+struct fo_stripe {
+	struct mutex lock;	/* writers of this stripe */
+	char *buf;		/* its share of dev->buf */
+	int size;		/* bytes of buf, a power of two */
+	unsigned long count;	/* bytes ever written to the stripe */
+	unsigned long tail;	/* oldest record still valid */
+	u64 nrec;		/* records written to the stripe */
+	int pend;		/* a writer has taken a seq it has not
+				 * published yet */
+	u64 pseq;		/* the last seq taken, never more than
+				 * the one pend is for */
+} ____cacheline_aligned_in_smp;
+
 /* This data structure describes one fanout device.  There
  * is one of these for each instance (minor #) of fanout */
 struct fo {
@@ -48,14 +236,105 @@ struct fo {
 	char *buf;		/* points to circular buffer, first char */
 	int indx;		/* where to put next char received */
 	loff_t count;		/* number chars received */
+	loff_t tail;		/* oldest byte or record still valid */
+	loff_t lastsync;	/* newest sync point written, or -1 */
+	int mode;		/* FO_MODE_* */
+	seqlock_t reglock;	/* register mode: guards reglen and value */
+	int reglen;		/* register mode: size of the value */
+	u64 nrec;		/* records written, framed mode */
+	int nopen;		/* open files, under sem */
 	wait_queue_head_t inq;	/* readers wait on this queue */
 	struct semaphore sem;	/* lock to keep buf/indx sane */
+	struct fo_idx *idx;	/* sparse record index, nidx entries */
+	int nidx;		/* size of the index ring */
+	int ifirst;		/* oldest index entry still valid */
+	int inum;		/* number of valid index entries */
+	int isince;		/* records written since the last entry */
+	struct fo_kcache *kc;	/* keyed last value cache, or NULL */
+	struct fo_pslot *prio;	/* urgent lane, or NULL until used */
+	u64 pcount;		/* urgent records ever written */
+	struct list_head groups;	/* consumer groups, fo_group */
+	int nfilt;		/* readers with a filter, under sem */
+	atomic64_t wmask[FO_NTAGS / 64];	/* tags readers on inq
+						 * wait for */
+	char *tname;		/* hierarchical name, or NULL */
+	struct list_head subs;	/* fo_subts of control device readers */
+	struct fo_commit *clog;	/* commit times, FO_CLOG_SIZE entries */
+	u64 nclog;		/* number of commits ever logged */
+	u64 lat[FO_LAT_NTYPES][FO_LAT_BUCKETS];	/* delivery latency */
+	struct list_head readers;	/* open fo_readers, under sem */
+	struct dentry *dbgdir;	/* debugfs directory of this minor */
+	struct fo_stripe *stripes;	/* striped mode: nstripes rings */
+	int nstripes;		/* striped mode: number of stripes */
+	int ssize;		/* striped mode: bytes per stripe */
+	unsigned int sflags;	/* striped mode: FO_ST_* */
+	atomic64_t sseq;	/* striped mode: next record number */
+	atomic_t swriters;	/* striped mode: writers given a stripe */
 #ifdef DEV_MKNOD
 	struct device *dev;	/* automatic mknod */
 #endif /* DEV_MKNOD */
 };
 
 
+/* This data structure describes one open file on a fanout device.
+ * It is the file's private data.  Files opened for reading are on
+ * their device's readers list so the kernel can say who is slow. */
+struct fo_reader {
+	struct fo *dev;		/* the fanout device this file is on */
+	struct list_head list;	/* on dev->readers, or empty */
+	loff_t pos;		/* stream offset after the last read */
+	pid_t pid;		/* thread group of the opener */
+	char comm[TASK_COMM_LEN];	/* command name of the opener */
+	u64 bytes;		/* bytes delivered to this reader */
+	u64 overruns;		/* times read returned -EPIPE */
+	u64 lost;		/* bytes skipped by overrun or resync */
+	u64 lastread;		/* ktime_get_ns() of the last delivery */
+	unsigned int flags;	/* FO_RF_* */
+	int syncnext;		/* next write is a sync point */
+	char *snap;		/* records of a snapshot still to read */
+	int snaplen;		/* bytes in snap */
+	int snapoff;		/* next record in snap */
+	u64 nextseq;		/* framed: sequence number at pos */
+	int conflate;		/* conflate when lag exceeds this */
+	u64 sint;		/* sampling: min ns between records */
+	u32 severy;		/* sampling: deliver every Nth record */
+	u32 scount;		/* sampling: records still to skip */
+	u64 slast;		/* sampling: time of last record given */
+	u64 sampled;		/* records skipped by sampling */
+	u64 maxage;		/* skip records older than this, in ns */
+	u64 stale;		/* records skipped as older than maxage */
+	u64 ppos;		/* next urgent record to read */
+	u64 ulost;		/* urgent records overwritten unread */
+	int urgent;		/* next write goes to the urgent lane */
+	struct fo_group *grp;	/* consumer group joined, or NULL */
+	struct list_head gnode;	/* on grp->members */
+	u32 gid;		/* id in its group, for keyed picks */
+	wait_queue_head_t wq;	/* keyed group members and filtered
+				 * readers wait here */
+	struct bpf_prog *filter;	/* records to deliver, or NULL */
+	int fready;		/* a record since pos passed the filter */
+	u64 filtered;		/* records skipped by filter or tag */
+	u64 tmask[FO_NTAGS / 64];	/* tags this reader wants */
+	int tagged;		/* tmask is not all ones */
+	int tag;		/* tag of records this file writes */
+	char *tx;		/* records of an open transaction, with
+				 * their headers, or NULL */
+	int txlen;		/* bytes in tx */
+	int txsize;		/* room in tx, see FO_TX_MIN */
+	struct mutex slock;	/* striped mode: reads of this file,
+				 * and spos */
+	struct rw_semaphore swrite;	/* striped mode: writes of this
+				 * file hold it shared, so their
+				 * threads do not queue behind each
+				 * other; a mode change exclusive */
+	unsigned long *spos;	/* striped mode: next record of each
+				 * stripe to read */
+	int snext;		/* striped mode: stripe to look at first */
+	int stripe;		/* striped mode: the stripe this file
+				 * writes, or -1 until its first write */
+};
+
+
 /*  Function prototypes.  */
 int fanout_init_module(void);
 void fanout_exit_module(void);
@@ -64,22 +343,91 @@ static int fanout_release(struct inode *, struct file *);
 static ssize_t fanout_read(struct file *, char *, size_t, loff_t *);
 static ssize_t fanout_write(struct file *, const char *, size_t, loff_t *);
 static unsigned int fanout_poll(struct file *, poll_table *);
+static long fanout_ioctl(struct file *, unsigned int, unsigned long);
+static loff_t fanout_llseek(struct file *, loff_t, int);
+static int fo_is_rec(struct fo *, loff_t);
+static loff_t fo_oldest(struct fo *);
+static int fo_maxwrite(struct fo *);
+static void fo_setpos(struct fo_reader *, struct file *, loff_t);
+static loff_t fo_rec_walk(struct fo *, loff_t, u64, u64);
+static int fo_rec_put(struct fo *, loff_t, const char __user *, int, u32,
+		      int, u64);
+static u64 fo_gseq_take(struct fo *, int);
+static loff_t fo_syncpos(struct fo *);
+static ssize_t fo_read_reg(struct fo_reader *, char __user *, size_t,
+			   loff_t *);
+static int fo_write_reg(struct fo *, const char __user *, size_t);
+static void fo_reset(struct fo_reader *, struct file *, int);
+static int fo_stripe_set(struct fo_reader *, struct file *,
+			 struct fo_stripecfg *);
+static void fo_stripe_free(struct fo *);
+static ssize_t fo_read_stripe(struct fo_reader *, char __user *, size_t);
+static ssize_t fo_write_stripe(struct fo_reader *, const char __user *,
+			       size_t);
+static int fo_stripe_ready(struct fo_reader *);
+static s64 fo_stripe_move(struct fo_reader *, int);
+static int fo_hdr_to_user(struct fo_reader *, char __user *,
+			  struct fo_rhdr *);
+static int fo_kc_set(struct fo *, struct fo_keycfg *);
+static void fo_kc_free(struct fo *);
+static void fo_kc_update(struct fo *, loff_t);
+static int fo_kc_snapshot(struct fo_reader *, u64, u32);
+static ssize_t fo_read_snap(struct fo_reader *, char __user *, size_t);
+static int fo_sample_skip(struct fo_reader *, struct fo_rhdr *);
+static int fo_rec_skip(struct fo_reader *, struct fo_rhdr *, loff_t);
+static long fo_recv_batch(struct file *, unsigned long);
+static int fo_prio_put(struct fo *, const char __user *, size_t);
+static ssize_t fo_read_prio(struct fo_reader *, char __user *, size_t);
+static int fo_grp_join(struct fo_reader *, struct fo_groupcfg *);
+static void fo_grp_leave(struct fo_reader *);
+static void fo_grp_wake(struct fo *, struct fo_group *);
+static int fo_grp_busy(struct fo *);
+static void fo_grp_free(struct fo *);
+static ssize_t fo_read_group(struct fo_reader *, char __user *, size_t);
+static int fo_filt_set(struct fo_reader *, struct fo_filter *);
+static void fo_filt_drop(struct fo_reader *);
+static int fo_filt_match(struct fo_reader *, loff_t);
+static int fo_filt_pending(struct fo_reader *, struct file *);
+static void fo_filt_wake(struct fo *, loff_t);
+static void fo_tag_want(struct fo_reader *);
+static int fo_tag_wanted(struct fo *, int);
+static int fo_ring_to_user(struct fo *, char __user *, loff_t, int);
+static int fo_ring_from_user(struct fo *, loff_t, const char __user *, int);
+static void fo_ring_get(struct fo *, void *, loff_t, int);
+static void fo_ring_put(struct fo *, loff_t, const void *, int);
+static void fo_commit(struct fo *, int);
+static int fo_published(struct fo *, loff_t);
+static int fo_tx_put(struct fo_reader *, const char __user *, size_t);
+static int fo_tx_commit(struct fo_reader *);
+static long fo_send_batch(struct file *, unsigned long);
+static void fo_commit_log(struct fo *);
+static void fo_lat_record(struct fo *, loff_t, int);
+static void fo_debugfs_init(void);
+static int fo_ctl_open(struct inode *, struct file *);
+static void fo_sub_stale(struct fo *);
+static void fo_sub_wake(struct fo *);
+static long fo_mpublish(struct fo_mpub __user *);
+static void fo_trie_free(struct fo_tnode *);
 
 
 /* Global variables */
 static int buffersize = 0x4000;		/* Circular buffer size 0x4000 (16K) */
+static int indexstride = 16;		/* records per index entry, framed */
+static int globalseq = 0;		/* give every framed record a gseq */
 static unsigned int numberofdevs = NUM_FO_DEVS;
 static int fo_major = 0;		/* major device number */
 /* debuglevel controls whether a printk is executed
  * 0 = no printk at all
  * 1 = printk on error only
  * 2 = printk on errors and on init/remove
- * 3 = debug printk to trace calls into fanout
- * 4 = debug trace inside of fanout calls 
+ * 3 = debug printk on open and close
+ * Reads, writes and polls are traced with the fanout:* tracepoints
+ * in fanout_trace.h instead of printk.
  */
 static unsigned int debuglevel = DEBUGLEVEL;	/* printk verbosity */
 
 struct cdev fo_cdev;		/* a char device global just 1 */
+static struct dentry *fo_dbgroot;	/* /sys/kernel/debug/fanout */
 dev_t fo_devicenumber;		/* first device number */
 
 #ifdef DEV_MKNOD
@@ -91,6 +439,8 @@ static char *fo_dev_devnode(struct device *dev, umode_t *mode);
 #endif /* DEV_MKNOD */
 
 module_param(buffersize, int, S_IRUSR);
+module_param(indexstride, int, S_IRUSR);
+module_param(globalseq, int, S_IRUSR);
 module_param(debuglevel, int, S_IRUSR);
 module_param(numberofdevs, int, S_IRUSR);
 #ifdef DEV_MKNOD
@@ -99,14 +449,26 @@ module_param(nodemode, int, S_IRUSR);
 
 static struct fo *fo_devs;	/* point to devices (minors) */
 
+/* The control device is the minor after the last topic */
+static DEFINE_MUTEX(fo_names_lock);	/* names, trie and fo_subs */
+static struct fo_tnode *fo_troot;	/* the name trie, or NULL */
+static LIST_HEAD(fo_subs);	/* subscriptions with patterns */
+#ifdef DEV_MKNOD
+static struct device *fo_ctldev;	/* /dev/fanoutctl */
+#endif /* DEV_MKNOD */
+static atomic64_t fo_gseq = ATOMIC64_INIT(0);	/* last global seq given */
+
 
 /* map the callbacks into this driver */
 static struct file_operations fanout_fops = {
 	.owner = THIS_MODULE,
+	.llseek = fanout_llseek,
 	.read = fanout_read,
 	.open = fanout_open,
 	.write = fanout_write,
 	.poll = fanout_poll,
+	.unlocked_ioctl = fanout_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 	.release = fanout_release
 };
 
@@ -117,6 +479,10 @@ MODULE_DESCRIPTION
 MODULE_AUTHOR("Bob Smith");
 MODULE_LICENSE("GPL");
 MODULE_PARM_DESC(buffersize, "Size of each buffer. default=16384 (16K) ");
+MODULE_PARM_DESC(indexstride,
+		 "Index every Nth record of framed devices. default=16");
+MODULE_PARM_DESC(globalseq,
+		 "Number all framed records across devices. default=0");
 MODULE_PARM_DESC(debuglevel, "Debug level. Higher=verbose. default=2");
 MODULE_PARM_DESC(numberofdevs,
 		 "Create this many minor devices. default=16");
@@ -128,6 +494,8 @@ MODULE_PARM_DESC(nodemode, "Special files permission bits. default=0666");
 int fanout_init_module(void)
 {
 	int i, err;
+	if (indexstride < 1)
+		indexstride = 1;
 	fo_devs = kmalloc(numberofdevs * sizeof(struct fo), GFP_KERNEL);
 	if (fo_devs == NULL) {
 		if (debuglevel >= 1)
@@ -143,6 +511,11 @@ int fanout_init_module(void)
 		fo_devs[i].indx = 0;		/* init index */
 		fo_devs[i].count = 0;		/* init count */
 		init_waitqueue_head(&fo_devs[i].inq);
+		INIT_LIST_HEAD(&fo_devs[i].readers);
+		INIT_LIST_HEAD(&fo_devs[i].groups);
+		INIT_LIST_HEAD(&fo_devs[i].subs);
+		fo_devs[i].lastsync = -1;
+		seqlock_init(&fo_devs[i].reglock);
 #ifdef init_MUTEX
 		init_MUTEX(&fo_devs[i].sem);	/* init sema */
 #else
@@ -151,7 +524,9 @@ int fanout_init_module(void)
 
 	}
 
-	err = alloc_chrdev_region(&fo_devicenumber, 0, numberofdevs, DEVNAME);
+	/* one more minor for the control device */
+	err = alloc_chrdev_region(&fo_devicenumber, 0, numberofdevs + 1,
+			DEVNAME);
 	if (err < 0) {
 		if (debuglevel >= 1)
 			printk(KERN_ALERT "%s: init fails. err=%d.\n",
@@ -179,7 +554,7 @@ int fanout_init_module(void)
 	fo_class->devnode = fo_dev_devnode;
 #endif /* DEV_MKNOD */
 
-	err = cdev_add(&fo_cdev, fo_devicenumber, numberofdevs);
+	err = cdev_add(&fo_cdev, fo_devicenumber, numberofdevs + 1);
 	if (err < 0) {
 		if (debuglevel >= 1)
 			printk(KERN_ALERT "%s: init fails. err=%d.\n",
@@ -201,8 +576,16 @@ int fanout_init_module(void)
 		}
 
 	}
+	fo_ctldev = device_create(fo_class, NULL,
+		MKDEV(fo_major, numberofdevs), NULL, "%sctl", DEVNAME);
+	if (IS_ERR(fo_ctldev) && (debuglevel >= 1)) {
+		printk(KERN_ALERT "%sctl: device_create fails. err=%ld.\n",
+			DEVNAME, PTR_ERR(fo_ctldev));
+	}
 #endif /* DEV_MKNOD */
 
+	fo_debugfs_init();
+
 	if (debuglevel >= 2) {
 		printk(KERN_INFO
 			"%s: Installed %d minor devices on major number %d.\n",
@@ -219,6 +602,14 @@ void fanout_exit_module(void)
 	if (!fo_devs)		/* anything to release ? */
 		return;
 
+	debugfs_remove_recursive(fo_dbgroot);
+
+#ifdef DEV_MKNOD
+	device_destroy(fo_class, MKDEV(fo_major, numberofdevs));
+#endif /* DEV_MKNOD */
+	fo_trie_free(fo_troot);
+	fo_troot = NULL;
+
 	for (i = 0; i < numberofdevs; i++) {	/* for every minor */
 
 #ifdef DEV_MKNOD
@@ -228,6 +619,13 @@ void fanout_exit_module(void)
 
 		if (fo_devs[i].buf)
 			kfree(fo_devs[i].buf);	/* free alloced memory */
+		kfree(fo_devs[i].clog);
+		kvfree(fo_devs[i].idx);
+		kfree(fo_devs[i].prio);
+		kfree(fo_devs[i].tname);
+		fo_grp_free(&fo_devs[i]);
+		fo_kc_free(&fo_devs[i]);
+		fo_stripe_free(&fo_devs[i]);
 	}
 
 	cdev_del(&fo_cdev);		/* delete major device */
@@ -238,7 +636,7 @@ void fanout_exit_module(void)
 	class_destroy(fo_class);
 #endif /* DEV_MKNOD */
 
-	unregister_chrdev_region(fo_devicenumber, numberofdevs);
+	unregister_chrdev_region(fo_devicenumber, numberofdevs + 1);
 
 	if (debuglevel >= 2)
 		printk(KERN_INFO "%s: Uninstalled.\n", DEVNAME);
@@ -248,41 +646,114 @@ void fanout_exit_module(void)
 static int fanout_open(struct inode *inode, struct file *filp)
 {
 	int mnr = iminor(inode);
-	struct fo *dev = &fo_devs[mnr];
+	struct fo *dev;
+	struct fo_reader *rdr;
+	int i;
 	if (debuglevel >= 3)
 		printk(KERN_DEBUG "%s open. Minor#=%d\n", DEVNAME, mnr);
 
-	if (down_interruptible(&dev->sem))	/* prevent races on open */
+	if (mnr == numberofdevs)	/* the control device */
+		return fo_ctl_open(inode, filp);
+	dev = &fo_devs[mnr];
+
+	rdr = kzalloc(sizeof(struct fo_reader), GFP_KERNEL);
+	if (!rdr)
+		return -ENOMEM;
+	rdr->dev = dev;
+	memset(rdr->tmask, 0xff, sizeof(rdr->tmask));
+	INIT_LIST_HEAD(&rdr->list);
+	INIT_LIST_HEAD(&rdr->gnode);
+	init_waitqueue_head(&rdr->wq);
+	mutex_init(&rdr->slock);
+	init_rwsem(&rdr->swrite);
+	rdr->stripe = -1;
+	rdr->pid = task_tgid_vnr(current);
+	get_task_comm(rdr->comm, current);
+
+	if (down_interruptible(&dev->sem)) {	/* prevent races on open */
+		kfree(rdr);
 		return -ERESTARTSYS;
+	}
 
 	if (!dev->buf) {
 		/* alloc the buffer, shared by all readers */
 		dev->buf = kmalloc(buffersize, GFP_KERNEL);
-		if (!dev->buf) {
+		dev->clog = kcalloc(FO_CLOG_SIZE, sizeof(struct fo_commit),
+				GFP_KERNEL);
+		/* enough index entries for a buffer of 1 byte records */
+		dev->nidx = buffersize / (FO_RHDR_SIZE + 1) / indexstride + 2;
+		dev->idx = kvcalloc(dev->nidx, sizeof(struct fo_idx),
+				GFP_KERNEL);
+		if (!dev->buf || !dev->clog || !dev->idx) {
+			kfree(dev->buf);
+			kfree(dev->clog);
+			kvfree(dev->idx);
+			dev->buf = NULL;
+			dev->clog = NULL;
+			dev->idx = NULL;
 			if (debuglevel >= 1) {
 				printk(KERN_ALERT "%s: No memory dev=%d.\n",
 						DEVNAME, mnr);
 			}
 			up(&dev->sem);	/* unlock sema */
+			kfree(rdr);
 			return -ENOMEM;
 		}
 	}
 
-	/* store which fanout device in the file's private data */
-	filp->private_data = (void *) dev;
+	/* a striped reader starts at the head of every stripe */
+	if (dev->mode == FO_MODE_STRIPED) {
+		rdr->spos = kcalloc(dev->nstripes, sizeof(unsigned long),
+				GFP_KERNEL);
+		if (!rdr->spos) {
+			up(&dev->sem);
+			kfree(rdr);
+			return -ENOMEM;
+		}
+		for (i = 0; i < dev->nstripes; i++)
+			rdr->spos[i] = smp_load_acquire(&dev->stripes[i].count);
+	}
 
-	/* define the file to be immediately caught up with the fanout dev */
-	filp->f_pos = dev->count;
+	/* store the per-file state in the file's private data */
+	filp->private_data = (void *) rdr;
+
+	/* define the file to be immediately caught up with the fanout dev,
+	 * except that a register reader starts with the current value */
+	filp->f_pos = (dev->mode == FO_MODE_REGISTER) ?
+		fo_oldest(dev) : dev->count;
+	rdr->pos = filp->f_pos;
+	rdr->nextseq = dev->nrec;
+	rdr->ppos = dev->pcount;
+	dev->nopen++;
+	if (filp->f_mode & FMODE_READ)
+		list_add_tail(&rdr->list, &dev->readers);
 	up(&dev->sem);		/* unlock semaphore we are done */
-	return nonseekable_open(inode, filp);	/* success */
+
+	/* the file stays seekable, see fanout_llseek() */
+	return 0;			/* success */
 }
 
 
 static int fanout_release(struct inode *inode, struct file *filp)
 {
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
+
 	if (debuglevel >= 3)
 		printk(KERN_DEBUG "%s close. Minor#=%d.\n", DEVNAME,
-			((struct fo *) filp->private_data)->minor);
+			dev->minor);
+
+	down(&dev->sem);	/* close can not be interrupted */
+	dev->nopen--;
+	list_del(&rdr->list);
+	if (rdr->grp)
+		fo_grp_leave(rdr);
+	fo_filt_drop(rdr);
+	up(&dev->sem);
+	kvfree(rdr->snap);
+	kvfree(rdr->tx);	/* an open transaction is dropped */
+	kfree(rdr->spos);
+	kfree(rdr);
 
 	return 0;			/* success */
 }
@@ -293,62 +764,194 @@ static ssize_t fanout_read(struct file *filp, char __user * buff,
 {
 	int ret;
 	loff_t xfer;		/* num bytes read from fanout buf */
-	int cpcnt, cpstrt;	/* cp count and start location */
-	struct fo *dev = (struct fo *) filp->private_data;
+	struct fo_rhdr h;	/* header of the next record, if framed */
+	int hlen;		/* size of a user header, if wanted */
+	int lattype = FO_LAT_READY;	/* did we have to wait for data */
+	loff_t start;		/* first byte returned, for latency */
+	loff_t skipto;		/* end of the records stepped over */
+	int cursor;		/* a read() at the file's own offset */
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
+
+	/* Registers are read without taking the semaphore */
+	if (dev->mode == FO_MODE_REGISTER)
+		return fo_read_reg(rdr, buff, count, offset);
+	/* and stripes without taking any lock their writers take */
+	if (dev->mode == FO_MODE_STRIPED)
+		return fo_read_stripe(rdr, buff, count);
 
 	if (down_interruptible(&dev->sem))	/* lock semaphore */
 		return -ERESTARTSYS;
 
-	if (debuglevel >= 3)
-		printk(KERN_DEBUG "%s: read %zu char from dev%d, off=%lld.\n",
-		   DEVNAME, count, dev->minor, *offset);
+	/* Group members share the group's cursor, not their own */
+	if (rdr->grp)
+		return fo_read_group(rdr, buff, count);
+
+	/* A pread() elsewhere, maybe one of several in other threads,
+	 * reads just the bytes or record at its offset.  It leaves the
+	 * reader's position, sampling, counters and lane alone, and
+	 * does not wait. */
+	cursor = (*offset == filp->f_pos);
+	if (!cursor && (*offset == dev->count)) {
+		up(&dev->sem);
+		return -EAGAIN;
+	}
+
+again:
+	/* Urgent records go ahead of everything else */
+	if (cursor && (rdr->ppos != dev->pcount)) {
+		ret = fo_read_prio(rdr, buff, count);
+		up(&dev->sem);
+		return ret;
+	}
+
+	/* A snapshot of the keyed cache comes before any live record */
+	if (cursor && rdr->snap) {
+		ret = fo_read_snap(rdr, buff, count);
+		up(&dev->sem);
+		return ret;
+	}
 
 	/* Wait here until new data is available */
-	while (*offset == dev->count) {
+	while ((*offset == dev->count) && (rdr->ppos == dev->pcount)) {
+		trace_fanout_read_wait(dev->minor, *offset, dev->count);
+		rdr->fready = 0;	/* the writer sets it on a match */
+		if (!rdr->filter)
+			fo_tag_want(rdr);
 		up(&dev->sem);		/* unlock sema */
-		if (wait_event_interruptible(dev->inq, (*offset != dev->count)))
+		if (rdr->filter)
+			ret = wait_event_interruptible(rdr->wq, rdr->fready ||
+					(rdr->ppos != dev->pcount));
+		else
+			ret = wait_event_interruptible(dev->inq,
+					(*offset != dev->count) ||
+					(rdr->ppos != dev->pcount));
+		if (ret)
 			return -ERESTARTSYS;
 		if (down_interruptible(&dev->sem))	/* lock */
 			return -ERESTARTSYS;
+		trace_fanout_read_wake(dev->minor, *offset, dev->count);
+		lattype = FO_LAT_WOKEN;
+	}
+	if (rdr->ppos != dev->pcount)
+		goto again;
+
+	/* A conflating reader that fell too far behind, or off the end
+	 * of the buffer, gets only the newest record of each key it
+	 * missed.  Then it carries on live from the head; the bytes
+	 * jumped over count as lost. */
+	if (cursor && rdr->conflate && dev->kc &&
+			((*offset < fo_oldest(dev)) ||
+			(dev->count - *offset > rdr->conflate))) {
+		ret = fo_kc_snapshot(rdr, rdr->nextseq, FO_REC_CONFL);
+		if (ret < 0) {
+			up(&dev->sem);
+			return ret;
+		}
+		fo_setpos(rdr, filp, dev->count);
+		*offset = dev->count;
+		goto again;
 	}
 
 	/* Verify that data requested is in the buffer or is next byte */
-	xfer = dev->count - *offset;	/* send count minus requested pointer */
-	if ((xfer > (loff_t) buffersize) || (xfer < 0)) {
-		printk(KERN_DEBUG "%s: Overrun. xfer=%lld buffersize=%d",
-				 DEVNAME, xfer, buffersize);
+	if ((*offset < fo_oldest(dev)) || (*offset > dev->count)) {
+		if (!cursor) {
+			up(&dev->sem);
+			return -EPIPE;	/* not the reader's overrun */
+		}
+		trace_fanout_overrun(dev->minor, *offset, dev->count);
+		rdr->overruns++;
+		/* Report the overrun once, but let the next read pick up
+		 * at the last sync point if the reader asked for that */
+		if (rdr->flags & FO_RF_SYNC)
+			fo_setpos(rdr, filp, fo_syncpos(dev));
 		up(&dev->sem);		/* unlock sema */
 		return -EPIPE;		/* buffer overrun */
 	}
 
-	/* Copy the new data out to the user */
-	xfer = dev->count - *offset;	/* amount of data available to copy */
+	/* A pread() or a read after lseek() in framed mode must start
+	 * on a record.  Sequential reads are known to. */
+	if ((dev->mode == FO_MODE_FRAMED) && (*offset != rdr->pos) &&
+			!fo_is_rec(dev, *offset)) {
+		up(&dev->sem);
+		return -EINVAL;
+	}
 
-	/* BUG: we need to check for a wrap on offset and count */
+	start = *offset;
+	if (dev->mode == FO_MODE_FRAMED) {
+		/* Give the user exactly one whole record, after its header
+		 * if the reader asked for headers */
+		fo_ring_get(dev, &h, *offset, FO_RHDR_SIZE);
 
-	 /* xfer less then available when requested */
-	xfer = ((loff_t)count < xfer) ? (loff_t)count : xfer;
-	ret = xfer;			/* we will handle these bytes */
-	while (xfer) {
-		/* copy start is where the reader last read (indx - (count - offset)) */
-		cpstrt = dev->indx - (dev->count - *offset);
-		if (cpstrt < 0) {	/* adjust copy count if needed */
-			cpcnt = ((loff_t)(-cpstrt) <  xfer) ? (loff_t)(-cpstrt) : xfer;
-			cpstrt += buffersize;
-		} else {
-			cpcnt = xfer;
+		/* Records the reader filters out, that are too old for
+		 * it, or that it does not sample are stepped over without
+		 * a copy.  The whole run of them is passed under this one
+		 * hold of the lock, and the reader moved once, at its end;
+		 * they count as skipped, not as lost. */
+		skipto = *offset;
+		while (cursor && fo_rec_skip(rdr, &h, skipto)) {
+			skipto += FO_RHDR_SIZE + h.len;
+			rdr->nextseq = h.seq + 1;
+			if (skipto == dev->count)
+				break;
+			fo_ring_get(dev, &h, skipto, FO_RHDR_SIZE);
+		}
+		if (skipto != *offset) {
+			/* Move the file too:  if the wait below ends in a
+			 * signal, *offset is never written back, and the
+			 * restarted read would count the run again */
+			filp->f_pos = skipto;
+			*offset = skipto;
+			rdr->pos = skipto;
+			start = skipto;
+			if (skipto == dev->count)
+				goto again;	/* wait for more */
 		}
 
-		if (copy_to_user(buff, dev->buf + cpstrt, cpcnt)) {
+		hlen = (rdr->flags & FO_RF_HDR) ? sizeof(struct fo_rec) : 0;
+		if (hlen + h.len > count) {
+			up(&dev->sem);
+			return -EMSGSIZE;	/* retry with a bigger buffer */
+		}
+		if (fo_hdr_to_user(rdr, buff, &h) < 0) {
+			up(&dev->sem);
+			return -EFAULT;
+		}
+		if (fo_ring_to_user(dev, buff + hlen, *offset + FO_RHDR_SIZE,
+				h.len)) {
 			up(&dev->sem);
 			return -EFAULT;
 		}
+		ret = hlen + h.len;
+		*offset += FO_RHDR_SIZE + h.len;
+		if (cursor) {
+			rdr->nextseq = h.seq + 1;
+			rdr->scount = rdr->severy ? rdr->severy - 1 : 0;
+			rdr->slast = h.ns;
+		}
+	} else {
+		/* Copy the new data out to the user */
+		xfer = dev->count - *offset;	/* amount of data available */
+
+		/* BUG: we need to check for a wrap on offset and count */
 
-		buff += cpcnt;
-		xfer -= cpcnt;
-		*offset += cpcnt;
+		 /* xfer less then available when requested */
+		xfer = ((loff_t)count < xfer) ? (loff_t)count : xfer;
+		ret = xfer;			/* we will handle these bytes */
+		if (fo_ring_to_user(dev, buff, *offset, ret)) {
+			up(&dev->sem);
+			return -EFAULT;
+		}
+		*offset += ret;
 	}
 
+	if (cursor) {
+		fo_lat_record(dev, start, lattype);
+		rdr->pos = *offset;
+	}
+	rdr->bytes += ret;
+	rdr->lastread = ktime_get_ns();
+	trace_fanout_read(dev->minor, ret, *offset, dev->count);
 	up(&dev->sem);		/* unlock sema */
 
 	return ret;
@@ -360,54 +963,94 @@ static ssize_t fanout_write(
 	const char __user * buff,
 	size_t count, loff_t * off)
 {
-	struct fo *dev = filp->private_data;
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
 
 	int ret;
-	int xfer;			/* num bytes to read from user */
-	int cpcnt;		/* num bytes in a copy */
+	loff_t start;		/* where this write goes */
+	int wake = 1;		/* does a reader on inq want this */
+
+	/* A striped writer locks only its own stripe */
+	if (dev->mode == FO_MODE_STRIPED)
+		return fo_write_stripe(rdr, buff, count);
 
 	if (down_interruptible(&dev->sem)) {	/* lock semaphore */
 		return -ERESTARTSYS;
 	}
+	start = dev->count;
 
-	if (debuglevel >= 3)
-		printk(KERN_DEBUG "%s: write %zu char to dev%d, off=%d.\n",
-		   DEVNAME, count, dev->minor, (int) *off);
-
-	/* Copy at most one-quarter of the circular buffer size.  This
-	 * gives readers more of a chance to wake up and get some data 
-	 * In other words feed the reader little chuncks of data, they will
-	 * call again if they still want more
-	 */
-	ret = xfer = min((int) count, buffersize / 4);
-
-	/* loop over the amount since the buffer is not a single block
-	 * but wraps arround
-	 */
-	while (xfer) {
-		cpcnt = buffersize - dev->indx;
-		cpcnt = min(cpcnt, xfer);
-
-		if (debuglevel >= 3)
-			printk(KERN_DEBUG "%s: write copy from user(%p,%p,%d)\n",
-		   	DEVNAME, dev->buf + dev->indx, buff, cpcnt);
-
-		if (copy_from_user(dev->buf + dev->indx, buff, cpcnt)) {
+	trace_fanout_write_start(dev->minor, count, dev->count);
+
+	if (dev->mode == FO_MODE_REGISTER) {
+		ret = fo_write_reg(dev, buff, count);
+		if (ret <= 0) {
+			up(&dev->sem);
+			return ret;
+		}
+	} else if (dev->mode == FO_MODE_FRAMED && rdr->urgent) {
+		/* An urgent record skips the bulk data in the buffer */
+		ret = fo_prio_put(dev, buff, count);
+		if (ret > 0)
+			rdr->urgent = 0;
+		if ((ret > 0) && dev->nfilt)
+			fo_filt_wake(dev, -1);
+		trace_fanout_write_commit(dev->minor, ret, dev->count);
+		up(&dev->sem);
+		if (ret > 0)
+			wake_up_interruptible(&dev->inq);
+		return ret;
+	} else if (dev->mode == FO_MODE_FRAMED && rdr->tx) {
+		/* Hold the record back until the transaction commits */
+		ret = fo_tx_put(rdr, buff, count);
+		if (ret > 0)
+			*off += ret;
+		up(&dev->sem);
+		return ret;
+	} else if (dev->mode == FO_MODE_FRAMED) {
+		/* A record is never split, so it must fit whole.  An empty
+		 * record would read as end of file, so drop it. */
+		if (count > fo_maxwrite(dev) || count == 0) {
+			up(&dev->sem);
+			return count ? -EMSGSIZE : 0;
+		}
+		ret = count;
+
+		if (fo_rec_put(dev, dev->count, buff, ret,
+				rdr->syncnext ? FO_REC_SYNC : 0, rdr->tag,
+				fo_gseq_take(dev, 1)) < 0) {
+			up(&dev->sem);	/* unlock semaphore */
+			return -EFAULT;
+		}
+		if (dev->kc)
+			fo_kc_update(dev, dev->count);
+		fo_commit(dev, FO_RHDR_SIZE + ret);
+		wake = fo_published(dev, start);
+	} else {
+		/* Copy at most one-quarter of the circular buffer size.  This
+		 * gives readers more of a chance to wake up and get some data 
+		 * In other words feed the reader little chuncks of data, they
+		 * will call again if they still want more
+		 */
+		ret = min((int) count, fo_maxwrite(dev));
+
+		if (fo_ring_from_user(dev, dev->count, buff, ret)) {
 			up(&dev->sem);	/* unlock semaphore */
 			return -EFAULT;
 		}
-		*off += cpcnt;
-		dev->indx += cpcnt;
-		dev->indx = (dev->indx == buffersize) ? 0 : dev->indx;
-		xfer -= cpcnt;	
-		buff += cpcnt;
+		fo_commit(dev, ret);
+	}
+	*off += ret;
+	if (rdr->syncnext && ret) {
+		dev->lastsync = start;
+		rdr->syncnext = 0;
 	}
 
-	dev->count += ret;		/* update file size */
+	trace_fanout_write_commit(dev->minor, ret, dev->count);
 	up(&dev->sem);			/* unlock semaphore */
 
 	/* This is what the readers have been waiting for */
-	wake_up_interruptible(&dev->inq);
+	if (wake)
+		wake_up_interruptible(&dev->inq);
 
 	return ret;
 }
@@ -417,20 +1060,3443 @@ static unsigned int fanout_poll(struct file *filp, poll_table * ppt)
 	/* The circular buffer is always available for writing */
 	int ready_mask = POLLOUT | POLLWRNORM;
 
-	struct fo *dev = filp->private_data;
-	poll_wait(filp, &dev->inq, ppt);
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
 
-	if (filp->f_pos != dev->count) {
-		ready_mask = (POLLIN | POLLRDNORM);
+	/* Group members and filtered readers are woken only for the
+	 * records that are theirs, everyone else for every record */
+	if (rdr->grp) {
+		/* a group member can read when the next record is its own */
+		poll_wait(filp, rdr->grp->keylen ? &rdr->wq : &rdr->grp->wq,
+				ppt);
+		if ((rdr->grp->pos != dev->count) &&
+				(!rdr->grp->keylen || rdr->grp->owner == rdr))
+			ready_mask = (POLLIN | POLLRDNORM);
+	} else if (rdr->filter) {
+		poll_wait(filp, &rdr->wq, ppt);
+		down(&dev->sem);
+		if (fo_filt_pending(rdr, filp))
+			ready_mask = (POLLIN | POLLRDNORM);
+		up(&dev->sem);
+	} else if (dev->mode == FO_MODE_STRIPED) {
+		poll_wait(filp, &dev->inq, ppt);
+		mutex_lock(&rdr->slock);
+		if (fo_stripe_ready(rdr))
+			ready_mask = (POLLIN | POLLRDNORM);
+		mutex_unlock(&rdr->slock);
+	} else {
+		poll_wait(filp, &dev->inq, ppt);
+		fo_tag_want(rdr);
+		if ((filp->f_pos != dev->count) || rdr->snap)
+			ready_mask = (POLLIN | POLLRDNORM);
 	}
+	if (!rdr->grp && (rdr->ppos != dev->pcount))
+		ready_mask = (POLLIN | POLLRDNORM | POLLPRI);
 
-	if (debuglevel >= 3)
-		printk(KERN_DEBUG "%s: poll returns 0x%x\n",
-					DEVNAME, ready_mask);
+	trace_fanout_poll(dev->minor, filp->f_pos, dev->count, ready_mask);
 
 	return ready_mask;
 }
 
+
+static long fanout_ioctl(struct file *filp, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
+	struct fo_info info;
+	struct fo_replay rp;
+	struct fo_keycfg kcfg;
+	struct fo_sample smp;
+	struct fo_stats st;
+	struct fo_groupcfg gcfg;
+	struct fo_filter filt;
+	struct fo_tagmask tm;
+	struct fo_stripecfg scfg;
+	u64 maxage;
+	int i;
+	struct fo_rhdr h;
+	loff_t lag, newpos;
+	u64 lost, key;
+	long ret = 0;
+
+	/* Batched calls copy in and wait, so they take the semaphore
+	 * themselves */
+	if (cmd == FO_IOC_RECVMMSG)
+		return fo_recv_batch(filp, arg);
+	if (cmd == FO_IOC_SENDMMSG)
+		return fo_send_batch(filp, arg);
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	lag = dev->count - filp->f_pos;
+
+	/* A striped device has no one stream to take offsets in */
+	if (dev->mode == FO_MODE_STRIPED) {
+		switch (cmd) {
+		case FO_IOC_LAG:
+		case FO_IOC_SKIP:
+		case FO_IOC_REWIND:
+			lag = fo_stripe_move(rdr, cmd);
+			if (cmd == FO_IOC_LAG)
+				ret = put_user((__s64) lag,
+						(__s64 __user *) arg);
+			up(&dev->sem);
+			return ret;
+		case FO_IOC_LOST:
+		case FO_IOC_INFO:
+		case FO_IOC_SETMODE:
+		case FO_IOC_SETFLAGS:
+		case FO_IOC_STATS:
+		case FO_IOC_STRIPES:
+			break;
+		default:
+			up(&dev->sem);
+			return -EINVAL;
+		}
+	}
+
+	switch (cmd) {
+	case FIONREAD:
+		if (rdr->ppos != dev->pcount) {
+			/* the oldest urgent record still kept comes next */
+			key = rdr->ppos;
+			if (dev->pcount - key > FO_PRIO_SLOTS)
+				key = dev->pcount - FO_PRIO_SLOTS;
+			lag = dev->prio[key & (FO_PRIO_SLOTS - 1)].h.len;
+			if (rdr->flags & FO_RF_HDR)
+				lag += sizeof(struct fo_rec);
+			ret = put_user((int) lag, (int __user *) arg);
+			break;
+		}
+		if (rdr->snap) {
+			memcpy(&h, rdr->snap + rdr->snapoff, FO_RHDR_SIZE);
+			lag = h.len;
+			if (rdr->flags & FO_RF_HDR)
+				lag += sizeof(struct fo_rec);
+			ret = put_user((int) lag, (int __user *) arg);
+			break;
+		}
+		if (dev->mode == FO_MODE_REGISTER) {
+			/* a new value is waiting, or not */
+			ret = put_user(lag ? dev->reglen : 0, (int __user *) arg);
+			break;
+		}
+		if (filp->f_pos < fo_oldest(dev)) {
+			ret = -EPIPE;	/* a read would fail too */
+			break;
+		}
+		/* a framed read returns just the next record */
+		if (dev->mode == FO_MODE_FRAMED && lag) {
+			fo_ring_get(dev, &h, filp->f_pos, FO_RHDR_SIZE);
+			lag = h.len;
+			if (rdr->flags & FO_RF_HDR)
+				lag += sizeof(struct fo_rec);
+		}
+		ret = put_user((int) lag, (int __user *) arg);
+		break;
+
+	case FO_IOC_LAG:
+		if (rdr->grp)
+			lag = dev->count - rdr->grp->pos;
+		ret = put_user((__s64) lag, (__s64 __user *) arg);
+		break;
+
+	case FO_IOC_LOST:
+		if (rdr->grp) {		/* lost by the group as a whole */
+			ret = put_user(rdr->grp->lost, (__u64 __user *) arg);
+			break;
+		}
+		lost = rdr->lost;
+		if (filp->f_pos < fo_oldest(dev))	/* overrun, not resynced */
+			lost += fo_oldest(dev) - filp->f_pos;
+		ret = put_user(lost, (__u64 __user *) arg);
+		break;
+
+	case FO_IOC_SKIP:
+	case FO_IOC_REWIND:
+		fo_setpos(rdr, filp, (cmd == FO_IOC_SKIP) ?
+			dev->count : fo_oldest(dev));
+		break;
+
+	case FO_IOC_INFO:
+		info.bufsize = buffersize;
+		info.maxwrite = fo_maxwrite(dev);
+		info.mode = dev->mode;
+		if (copy_to_user((void __user *) arg, &info, sizeof(info)))
+			ret = -EFAULT;
+		break;
+
+	case FO_IOC_SETMODE:
+		/* Only the sole user of a device may change its mode, and
+		 * doing so discards whatever is in the buffer */
+		if (arg != FO_MODE_STREAM && arg != FO_MODE_FRAMED &&
+				arg != FO_MODE_REGISTER)
+			ret = -EINVAL;
+		else if ((dev->nopen != 1) || fo_grp_busy(dev))
+			ret = -EBUSY;
+		else
+			fo_reset(rdr, filp, arg);
+		break;
+
+	case FO_IOC_STRIPES:
+		if (copy_from_user(&scfg, (void __user *) arg, sizeof(scfg)))
+			ret = -EFAULT;
+		else
+			ret = fo_stripe_set(rdr, filp, &scfg);
+		break;
+
+	case FO_IOC_REPLAY:
+		if (copy_from_user(&rp, (void __user *) arg, sizeof(rp))) {
+			ret = -EFAULT;
+			break;
+		}
+		newpos = fo_oldest(dev);
+		if ((dev->mode == FO_MODE_REGISTER) &&
+				(rp.from != FO_REPLAY_OLDEST)) {
+			ret = -EINVAL;	/* there is only the one value */
+			break;
+		}
+		if (rp.from == FO_REPLAY_BYTES) {
+			if (rp.n < dev->count - newpos)
+				newpos = dev->count - rp.n;
+			/* start a framed reader on a record boundary */
+			if (dev->mode == FO_MODE_FRAMED)
+				newpos = fo_rec_walk(dev, newpos, 0, 0);
+		} else if (rp.from == FO_REPLAY_RECORDS) {
+			if (dev->mode != FO_MODE_FRAMED) {
+				ret = -EINVAL;	/* no records in a stream */
+				break;
+			}
+			if (rp.n < dev->nrec)
+				newpos = fo_rec_walk(dev, 0,
+						dev->nrec - rp.n, 0);
+		} else if (rp.from == FO_REPLAY_SYNC) {
+			if (fo_syncpos(dev) == dev->count) {
+				ret = -ENOENT;	/* no sync point retained */
+				break;
+			}
+			newpos = fo_syncpos(dev);
+		} else if (rp.from != FO_REPLAY_OLDEST) {
+			ret = -EINVAL;
+			break;
+		}
+		fo_setpos(rdr, filp, newpos);
+		break;
+
+	case FO_IOC_SEEK_SEQ:
+	case FO_IOC_SEEK_TIME:
+		if (dev->mode != FO_MODE_FRAMED) {
+			ret = -EINVAL;
+			break;
+		}
+		if (get_user(key, (__u64 __user *) arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (cmd == FO_IOC_SEEK_TIME) {
+			newpos = fo_rec_walk(dev, 0, 0, key);
+		} else {
+			/* refuse a sequence number that is already gone */
+			if (dev->tail < dev->count) {
+				fo_ring_get(dev, &h, dev->tail, FO_RHDR_SIZE);
+				if (key < h.seq) {
+					ret = -ENOENT;
+					break;
+				}
+			}
+			newpos = fo_rec_walk(dev, 0, key, 0);
+		}
+		fo_setpos(rdr, filp, newpos);
+		break;
+
+	case FO_IOC_SETKEY:
+		if (copy_from_user(&kcfg, (void __user *) arg, sizeof(kcfg)))
+			ret = -EFAULT;
+		else if (!(filp->f_mode & FMODE_WRITE))
+			ret = -EPERM;	/* only publishers configure */
+		else
+			ret = fo_kc_set(dev, &kcfg);
+		break;
+
+	case FO_IOC_SNAPSHOT:
+		if (!dev->kc) {
+			ret = -EINVAL;
+			break;
+		}
+		kvfree(rdr->snap);
+		rdr->snap = NULL;
+		ret = fo_kc_snapshot(rdr, 0, FO_REC_SNAP);
+		if (ret == 0)	/* the live records follow the snapshot */
+			fo_setpos(rdr, filp, dev->count);
+		break;
+
+	case FO_IOC_CONFLATE:
+		if (!dev->kc && arg)
+			ret = -EINVAL;	/* needs keys to conflate by */
+		else if (arg > INT_MAX)
+			ret = -EINVAL;
+		else
+			rdr->conflate = arg;
+		break;
+
+	case FO_IOC_SAMPLE:
+		if (copy_from_user(&smp, (void __user *) arg, sizeof(smp))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (dev->mode != FO_MODE_FRAMED && (smp.interval || smp.every)) {
+			ret = -EINVAL;	/* sampling is by record */
+			break;
+		}
+		rdr->sint = smp.interval;
+		rdr->severy = smp.every;
+		rdr->scount = 0;
+		rdr->slast = 0;
+		break;
+
+	case FO_IOC_MAXAGE:
+		if (get_user(maxage, (__u64 __user *) arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (dev->mode != FO_MODE_FRAMED && maxage) {
+			ret = -EINVAL;	/* only records have a time */
+			break;
+		}
+		rdr->maxage = maxage;
+		break;
+
+	case FO_IOC_STATS:
+		memset(&st, 0, sizeof(st));
+		st.size = offsetof(struct fo_stats, reserved);
+		st.bytes = rdr->bytes;
+		st.overruns = rdr->overruns;
+		st.lost = rdr->lost;
+		st.sampled = rdr->sampled;
+		st.stale = rdr->stale;
+		st.ulost = rdr->ulost;
+		st.filtered = rdr->filtered;
+		if (copy_to_user((void __user *) arg, &st, sizeof(st)))
+			ret = -EFAULT;
+		break;
+
+	case FO_IOC_SYNCPOINT:
+		rdr->syncnext = 1;
+		break;
+
+	case FO_IOC_JOIN:
+		if (copy_from_user(&gcfg, (void __user *) arg, sizeof(gcfg)))
+			ret = -EFAULT;
+		else if (!(filp->f_mode & FMODE_READ))
+			ret = -EPERM;
+		else
+			ret = fo_grp_join(rdr, &gcfg);
+		if (ret == 0)
+			filp->f_pos = rdr->pos;
+		break;
+
+	case FO_IOC_SETFILTER:
+		if (copy_from_user(&filt, (void __user *) arg, sizeof(filt)))
+			ret = -EFAULT;
+		else
+			ret = fo_filt_set(rdr, &filt);
+		break;
+
+	case FO_IOC_SETTAG:
+		if ((arg >= FO_NTAGS) || (arg && (dev->mode != FO_MODE_FRAMED)))
+			ret = -EINVAL;
+		else
+			rdr->tag = arg;
+		break;
+
+	case FO_IOC_SETMASK:
+		if (copy_from_user(&tm, (void __user *) arg, sizeof(tm))) {
+			ret = -EFAULT;
+			break;
+		}
+		for (i = 0; i < FO_NTAGS / 64; i++) {
+			if (~tm.bits[i])
+				break;
+		}
+		if ((i < FO_NTAGS / 64) && (dev->mode != FO_MODE_FRAMED)) {
+			ret = -EINVAL;	/* only records have tags */
+			break;
+		}
+		memcpy(rdr->tmask, tm.bits, sizeof(rdr->tmask));
+		rdr->tagged = (i < FO_NTAGS / 64);
+		rdr->fready = 1;
+		wake_up_interruptible(&rdr->wq);
+		wake_up_interruptible(&dev->inq);	/* sleep on the new mask */
+		break;
+
+	case FO_IOC_TXBEGIN:
+		if (!(filp->f_mode & FMODE_WRITE))
+			ret = -EPERM;
+		else if (dev->mode != FO_MODE_FRAMED)
+			ret = -EINVAL;
+		else if (rdr->tx)
+			ret = -EBUSY;
+		else {
+			rdr->txsize = min(FO_TX_MIN, buffersize / 2);
+			rdr->tx = kvmalloc(rdr->txsize, GFP_KERNEL);
+			rdr->txlen = 0;
+			if (!rdr->tx)
+				ret = -ENOMEM;
+		}
+		break;
+
+	case FO_IOC_TXCOMMIT:
+		ret = fo_tx_commit(rdr);
+		break;
+
+	case FO_IOC_TXABORT:
+		if (!rdr->tx)
+			ret = -EINVAL;
+		kvfree(rdr->tx);
+		rdr->tx = NULL;
+		break;
+
+	case FO_IOC_URGENT:
+		if (dev->mode != FO_MODE_FRAMED)
+			ret = -EINVAL;
+		else
+			rdr->urgent = 1;
+		break;
+
+	case FO_IOC_SETFLAGS:
+		if (arg & ~FO_RF_ALL)
+			ret = -EINVAL;
+		else
+			rdr->flags = arg;
+		break;
+
+	default:
+		ret = -ENOTTY;
+	}
+
+	up(&dev->sem);
+	return ret;
+}
+
+
+/* Readers may seek anywhere in the retained data.  SEEK_SET and
+ * SEEK_CUR take absolute stream offsets, SEEK_END is relative to the
+ * newest byte, SEEK_DATA finds the oldest data at or after offset and
+ * SEEK_HOLE gives the head.  Framed readers must land on a record. */
+static loff_t fanout_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
+	loff_t pos;
+
+	if (dev->mode == FO_MODE_REGISTER)
+		return -ESPIPE;		/* only the one value to read */
+	if (dev->mode == FO_MODE_STRIPED)
+		return -ESPIPE;		/* an offset in every stripe */
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = filp->f_pos + offset;
+		break;
+	case SEEK_END:
+		pos = dev->count + offset;
+		break;
+	case SEEK_DATA:
+		if (offset > dev->count) {
+			up(&dev->sem);
+			return -ENXIO;
+		}
+		pos = max(offset, fo_oldest(dev));
+		if (dev->mode == FO_MODE_FRAMED)
+			pos = fo_rec_walk(dev, pos, 0, 0);
+		break;
+	case SEEK_HOLE:
+		pos = dev->count;
+		break;
+	default:
+		up(&dev->sem);
+		return -EINVAL;
+	}
+
+	if ((pos < fo_oldest(dev)) || (pos > dev->count) ||
+			((dev->mode == FO_MODE_FRAMED) && !fo_is_rec(dev, pos))) {
+		up(&dev->sem);
+		return -EINVAL;
+	}
+
+	fo_setpos(rdr, filp, pos);
+	up(&dev->sem);
+	return pos;
+}
+
+
+/* Is off the start of a retained record, or the head, of a framed
+ * topic.  Called with dev->sem held. */
+static int fo_is_rec(struct fo *dev, loff_t off)
+{
+	if ((off < dev->tail) || (off > dev->count))
+		return 0;
+	return fo_rec_walk(dev, off, 0, 0) == off;
+}
+
+
+/* Stream offset of the oldest byte, or in framed mode the oldest
+ * record, still in the circular buffer.  Called with dev->sem held. */
+static loff_t fo_oldest(struct fo *dev)
+{
+	if (dev->mode == FO_MODE_FRAMED)
+		return dev->tail;
+	if (dev->mode == FO_MODE_REGISTER)	/* the current value */
+		return (dev->count > dev->tail) ? dev->count - 1 : dev->count;
+	return max(dev->tail, dev->count - buffersize);
+}
+
+
+/* Where a reader resyncing to the newest sync point goes:  that
+ * point if it is still buffered, else the head.  Called with
+ * dev->sem held. */
+static loff_t fo_syncpos(struct fo *dev)
+{
+	if (dev->lastsync >= fo_oldest(dev))
+		return dev->lastsync;
+	return dev->count;
+}
+
+
+/* Most bytes one write() will take */
+static int fo_maxwrite(struct fo *dev)
+{
+	if (dev->mode == FO_MODE_FRAMED)
+		return buffersize / 4 - FO_RHDR_SIZE;
+	if (dev->mode == FO_MODE_REGISTER)
+		return buffersize / 2;
+	if (dev->mode == FO_MODE_STRIPED)
+		return dev->ssize / 4 - FO_RHDR_SIZE;
+	return buffersize / 4;
+}
+
+
+/* Put a device in mode, empty, for its sole open file rdr.
+ * Called with dev->sem held. */
+static void fo_reset(struct fo_reader *rdr, struct file *filp, int mode)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_subt *subt;
+
+	mutex_lock(&rdr->slock);
+	down_write(&rdr->swrite);
+	fo_stripe_free(dev);
+	kfree(rdr->spos);
+	rdr->spos = NULL;
+	up_write(&rdr->swrite);
+	mutex_unlock(&rdr->slock);
+
+	dev->mode = mode;
+	dev->tail = dev->count;
+	dev->lastsync = -1;
+	dev->inum = 0;
+	dev->isince = 0;
+	dev->reglen = 0;
+	fo_kc_free(dev);
+	if (rdr->grp)
+		fo_grp_leave(rdr);
+	fo_grp_free(dev);
+	fo_filt_drop(rdr);
+	memset(rdr->tmask, 0xff, sizeof(rdr->tmask));
+	rdr->tagged = 0;
+	rdr->tag = 0;
+	list_for_each_entry(subt, &dev->subs, dnode) {
+		subt->pos = dev->count;
+		subt->stale = 1;
+	}
+	filp->f_pos = dev->count;
+	rdr->pos = dev->count;
+	rdr->nextseq = dev->nrec;
+	rdr->ppos = dev->pcount;
+	rdr->urgent = 0;
+}
+
+
+/* Move a reader to stream offset pos.  Anything it jumps over that
+ * it had not read counts as lost.  Called with dev->sem held. */
+static void fo_setpos(struct fo_reader *rdr, struct file *filp, loff_t pos)
+{
+	struct fo_rhdr h;
+
+	if (pos > filp->f_pos)
+		rdr->lost += pos - filp->f_pos;
+	filp->f_pos = pos;
+	rdr->pos = pos;
+	rdr->fready = 1;	/* let the next read look */
+	if ((rdr->dev->mode == FO_MODE_FRAMED) && (pos < rdr->dev->count)) {
+		fo_ring_get(rdr->dev, &h, pos, FO_RHDR_SIZE);
+		rdr->nextseq = h.seq;
+	} else {
+		rdr->nextseq = rdr->dev->nrec;
+	}
+}
+
+
+/* Entry k of the valid part of the index, 0 being the oldest */
+static struct fo_idx *fo_idx_entry(struct fo *dev, int k)
+{
+	k += dev->ifirst;
+	return &dev->idx[(k >= dev->nidx) ? k - dev->nidx : k];
+}
+
+
+/* Offset of the newest indexed record that is not past the first
+ * record fo_rec_walk() looks for:  one that starts at or before off,
+ * is numbered seq or less, or was written before ns.  A key of 0
+ * matches nothing, so it does not hold the search back.  All three
+ * only grow along the index, so a binary search finds it.  Returns
+ * dev->tail if there is no such entry. */
+static loff_t fo_idx_find(struct fo *dev, loff_t off, u64 seq, u64 ns)
+{
+	struct fo_idx *e;
+	int lo = 0, hi = dev->inum, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = fo_idx_entry(dev, mid);
+		if ((off && (e->off <= off)) || (seq && (e->seq <= seq)) ||
+				(e->ns < ns))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? fo_idx_entry(dev, lo - 1)->off : dev->tail;
+}
+
+
+/* Find the first record of a framed topic that starts at or after
+ * off, is numbered seq or later and was written at or after ns.
+ * Returns its offset, or dev->count if there is none.  The index
+ * gets us within indexstride records of it.  Called with dev->sem
+ * held. */
+static loff_t fo_rec_walk(struct fo *dev, loff_t off, u64 seq, u64 ns)
+{
+	struct fo_rhdr h;
+	loff_t p = fo_idx_find(dev, off, seq, ns);
+
+	while (p < dev->count) {
+		fo_ring_get(dev, &h, p, FO_RHDR_SIZE);
+		if ((p >= off) && (h.seq >= seq) && (h.ns >= ns))
+			break;
+		p += FO_RHDR_SIZE + h.len;
+	}
+	return p;
+}
+
+
+/* Take n global sequence numbers for dev, one atomic operation for
+ * all of them, and return the first, or 0 if globalseq is off.  The
+ * caller holds dev->sem from now until the records are committed,
+ * which lets a merged read know that no smaller number is still to
+ * come, and the subscriptions on dev are told first to peek again;
+ * see fo_sub_read(). */
+static u64 fo_gseq_take(struct fo *dev, int n)
+{
+	if (!globalseq || (n == 0))
+		return 0;
+	fo_sub_stale(dev);
+	return atomic64_add_return(n, &fo_gseq) - n + 1;
+}
+
+
+/* Drop the oldest records of a framed topic until a record of len
+ * bytes fits at stream offset at.  Called with dev->sem held. */
+static void fo_rec_room(struct fo *dev, loff_t at, int len)
+{
+	struct fo_rhdr h;
+
+	while (at + FO_RHDR_SIZE + len - dev->tail > buffersize) {
+		fo_ring_get(dev, &h, dev->tail, FO_RHDR_SIZE);
+		dev->tail += FO_RHDR_SIZE + h.len;
+		while (dev->inum && fo_idx_entry(dev, 0)->off < dev->tail) {
+			dev->ifirst = (dev->ifirst + 1 == dev->nidx) ?
+				0 : dev->ifirst + 1;
+			dev->inum--;
+		}
+	}
+}
+
+
+/* Put the header of a record of len bytes at stream offset at, its
+ * data being there already, and index it.  Returns the bytes used.
+ * Called with dev->sem held. */
+static int fo_rec_hdr(struct fo *dev, loff_t at, int len, u32 flags,
+		      int tag, u64 gseq)
+{
+	struct fo_rhdr h;
+	struct fo_idx *e;
+
+	h.len = len;
+	h.flags = flags;
+	h.tag = tag;
+	h.pad = 0;
+	h.seq = dev->nrec++;
+	h.ns = ktime_get_ns();
+	h.gseq = gseq;
+	fo_ring_put(dev, at, &h, FO_RHDR_SIZE);
+
+	if (dev->isince++ == 0) {
+		if (dev->inum == dev->nidx) {	/* can not happen */
+			dev->ifirst = (dev->ifirst + 1 == dev->nidx) ?
+				0 : dev->ifirst + 1;
+			dev->inum--;
+		}
+		e = fo_idx_entry(dev, dev->inum++);
+		e->off = at;
+		e->seq = h.seq;
+		e->ns = h.ns;
+	}
+	if (dev->isince == indexstride)
+		dev->isince = 0;
+	return FO_RHDR_SIZE + len;
+}
+
+
+/* Copy one record of len bytes from the user into a framed topic at
+ * stream offset at, dropping the oldest records to make room.  The
+ * caller commits it.  Returns the bytes used or -EFAULT.  Called with
+ * dev->sem held. */
+static int fo_rec_put(struct fo *dev, loff_t at, const char __user *buff,
+		      int len, u32 flags, int tag, u64 gseq)
+{
+	fo_rec_room(dev, at, len);
+	if (fo_ring_from_user(dev, at + FO_RHDR_SIZE, buff, len))
+		return -EFAULT;
+	return fo_rec_hdr(dev, at, len, flags, tag, gseq);
+}
+
+
+/* As fo_rec_put(), from kernel memory */
+static int fo_rec_putk(struct fo *dev, loff_t at, const void *data,
+		       int len, u32 flags, int tag, u64 gseq)
+{
+	fo_rec_room(dev, at, len);
+	fo_ring_put(dev, at + FO_RHDR_SIZE, data, len);
+	return fo_rec_hdr(dev, at, len, flags, tag, gseq);
+}
+
+
+/* Index into dev->buf of stream offset off.  off must be within one
+ * buffer length of dev->count, either side. */
+static int fo_ring_idx(struct fo *dev, loff_t off)
+{
+	int i = dev->indx + (int) (off - dev->count);
+
+	if (i < 0)
+		i += buffersize;
+	else if (i >= buffersize)
+		i -= buffersize;
+	return i;
+}
+
+
+/* Copy n bytes at stream offset off out to the user.  The loop is
+ * needed since the buffer is not a single block but wraps around. */
+static int fo_ring_to_user(struct fo *dev, char __user *to, loff_t off, int n)
+{
+	int i = fo_ring_idx(dev, off);
+	int cpcnt;
+
+	while (n) {
+		cpcnt = min(n, buffersize - i);
+		if (copy_to_user(to, dev->buf + i, cpcnt))
+			return -EFAULT;
+		to += cpcnt;
+		n -= cpcnt;
+		i = 0;
+	}
+	return 0;
+}
+
+
+/* Copy n bytes from the user into the buffer at stream offset off */
+static int fo_ring_from_user(struct fo *dev, loff_t off,
+			     const char __user *from, int n)
+{
+	int i = fo_ring_idx(dev, off);
+	int cpcnt;
+
+	while (n) {
+		cpcnt = min(n, buffersize - i);
+		if (copy_from_user(dev->buf + i, from, cpcnt))
+			return -EFAULT;
+		from += cpcnt;
+		n -= cpcnt;
+		i = 0;
+	}
+	return 0;
+}
+
+
+/* Kernel side copies out of and into the buffer, for headers */
+static void fo_ring_get(struct fo *dev, void *to, loff_t off, int n)
+{
+	int i = fo_ring_idx(dev, off);
+	int cpcnt = min(n, buffersize - i);
+
+	memcpy(to, dev->buf + i, cpcnt);
+	memcpy((char *) to + cpcnt, dev->buf, n - cpcnt);
+}
+
+static void fo_ring_put(struct fo *dev, loff_t off, const void *from, int n)
+{
+	int i = fo_ring_idx(dev, off);
+	int cpcnt = min(n, buffersize - i);
+
+	memcpy(dev->buf + i, from, cpcnt);
+	memcpy(dev->buf, (const char *) from + cpcnt, n - cpcnt);
+}
+
+
+/* Make n bytes already copied in after dev->count visible to the
+ * readers.  Called with dev->sem held. */
+static void fo_commit(struct fo *dev, int n)
+{
+	dev->indx = fo_ring_idx(dev, dev->count + n);
+	dev->count += n;		/* update file size */
+	fo_commit_log(dev);
+}
+
+
+/* Framed records from start to dev->count were just committed.
+ * Wake the group members, filtered readers and subscriptions that
+ * want them.  Returns whether a reader on dev->inq wants one, by its
+ * tag.  Called by the writer with dev->sem held. */
+static int fo_published(struct fo *dev, loff_t start)
+{
+	struct fo_group *grp;
+	struct fo_rhdr h;
+	loff_t off;
+	int wake = 0;
+
+	for (off = start; off < dev->count; off += FO_RHDR_SIZE + h.len) {
+		fo_ring_get(dev, &h, off, FO_RHDR_SIZE);
+		if (dev->nfilt)
+			fo_filt_wake(dev, off);
+		if (!wake)
+			wake = fo_tag_wanted(dev, h.tag);
+	}
+	list_for_each_entry(grp, &dev->groups, list)
+		fo_grp_wake(dev, grp);
+	if (!list_empty(&dev->subs))
+		fo_sub_wake(dev);
+	return wake;
+}
+
+
+/* Copy the user's view of header h out if the reader asked for
+ * headers.  Returns the bytes used, or -EFAULT. */
+static int fo_hdr_to_user(struct fo_reader *rdr, char __user *buff,
+			  struct fo_rhdr *h)
+{
+	struct fo_rec rec;
+
+	if (!(rdr->flags & FO_RF_HDR))
+		return 0;
+	memset(&rec, 0, sizeof(rec));
+	rec.len = h->len;
+	rec.flags = h->flags;
+	rec.tag = h->tag;
+	rec.seq = h->seq;
+	rec.ns = h->ns;
+	rec.gseq = h->gseq;
+	if (copy_to_user(buff, &rec, sizeof(rec)))
+		return -EFAULT;
+	return sizeof(rec);
+}
+
+
+/* Turn the keyed cache of a framed device on, resize it, or turn it
+ * off with a zero keylen.  A new cache is filled from the records
+ * still in the buffer.  Called with dev->sem held. */
+static int fo_kc_set(struct fo *dev, struct fo_keycfg *cfg)
+{
+	struct fo_rhdr h;
+	loff_t p;
+
+	if (dev->mode != FO_MODE_FRAMED)
+		return -EINVAL;
+	if ((cfg->keylen > FO_MAXKEY) || (cfg->maxbytes > INT_MAX) ||
+			(cfg->keylen && !cfg->maxbytes))
+		return -EINVAL;
+
+	fo_kc_free(dev);
+	if (cfg->keylen == 0)
+		return 0;
+
+	dev->kc = kzalloc(sizeof(struct fo_kcache), GFP_KERNEL);
+	if (!dev->kc)
+		return -ENOMEM;
+	dev->kc->keylen = cfg->keylen;
+	dev->kc->maxbytes = cfg->maxbytes;
+	INIT_LIST_HEAD(&dev->kc->lru);
+	hash_init(dev->kc->hash);
+
+	for (p = dev->tail; p < dev->count; p += FO_RHDR_SIZE + h.len) {
+		fo_ring_get(dev, &h, p, FO_RHDR_SIZE);
+		fo_kc_update(dev, p);
+	}
+	return 0;
+}
+
+
+/* Drop one entry of the keyed cache.  The biggest entry dropped is
+ * kept as the spare, so a new key seldom needs a kmalloc().  The
+ * spare is the one entry not counted against kc->maxbytes. */
+static void fo_kc_drop(struct fo_kcache *kc, struct fo_kent *ent)
+{
+	hash_del(&ent->node);
+	list_del(&ent->lru);
+	kc->bytes -= FO_KENT_BYTES(ent);
+	kc->nkeys--;
+	if (kc->spare && (kc->spare->size >= ent->size)) {
+		kfree(ent);
+		return;
+	}
+	kfree(kc->spare);
+	kc->spare = ent;
+}
+
+
+/* Free the keyed cache of a device, if it has one */
+static void fo_kc_free(struct fo *dev)
+{
+	struct fo_kent *ent, *tmp;
+
+	if (!dev->kc)
+		return;
+	list_for_each_entry_safe(ent, tmp, &dev->kc->lru, lru)
+		fo_kc_drop(dev->kc, ent);
+	kfree(dev->kc->spare);
+	kfree(dev->kc);
+	dev->kc = NULL;
+}
+
+
+/* Make the record at stream offset off the cached one for its key,
+ * then drop the least recently updated keys until the cache is
+ * back under its limit.  Records shorter than a key are not cached.
+ * Called with dev->sem held. */
+static void fo_kc_update(struct fo *dev, loff_t off)
+{
+	struct fo_kcache *kc = dev->kc;
+	struct fo_kent *ent, *old = NULL;
+	char key[FO_MAXKEY];
+	struct fo_rhdr h;
+	size_t size;
+	u32 hash;
+
+	fo_ring_get(dev, &h, off, FO_RHDR_SIZE);
+	if (h.len < kc->keylen)
+		return;
+	fo_ring_get(dev, key, off + FO_RHDR_SIZE, kc->keylen);
+	hash = jhash(key, kc->keylen, 0);
+	hash_for_each_possible(kc->hash, ent, node, hash) {
+		if ((ent->hash == hash) &&
+				!memcmp(ent->data, key, kc->keylen)) {
+			old = ent;
+			break;
+		}
+	}
+
+	/* A key's new value goes over its old one if it fits, else in
+	 * the spare or, failing that, a new entry.  kmalloc() rounds up
+	 * to its size class anyway, so take all of it.  If there is no
+	 * memory the stale value must not stay either. */
+	if (old && (old->size >= h.len)) {
+		old->h = h;
+		fo_ring_get(dev, old->data, off + FO_RHDR_SIZE, h.len);
+		list_move_tail(&old->lru, &kc->lru);
+	} else {
+		if (old)
+			fo_kc_drop(kc, old);
+		if (kc->spare && (kc->spare->size >= h.len)) {
+			ent = kc->spare;
+			kc->spare = NULL;
+		} else {
+			size = kmalloc_size_roundup(sizeof(struct fo_kent) +
+					h.len);
+			ent = kmalloc(size, GFP_KERNEL);
+			if (!ent)
+				return;
+			ent->size = size - sizeof(struct fo_kent);
+		}
+		ent->hash = hash;
+		ent->h = h;
+		fo_ring_get(dev, ent->data, off + FO_RHDR_SIZE, h.len);
+		hash_add(kc->hash, &ent->node, hash);
+		list_add_tail(&ent->lru, &kc->lru);
+		kc->bytes += FO_KENT_BYTES(ent);
+		kc->nkeys++;
+	}
+
+	while (kc->bytes > kc->maxbytes)
+		fo_kc_drop(kc, list_first_entry(&kc->lru, struct fo_kent, lru));
+}
+
+
+/* Give a reader a private copy of the cached records numbered
+ * minseq or later, in the same header plus record format as the
+ * buffer and with flag set in their headers.  The cache is in update
+ * order, so the snapshot is too.  Called with dev->sem held. */
+static int fo_kc_snapshot(struct fo_reader *rdr, u64 minseq, u32 flag)
+{
+	struct fo_kcache *kc = rdr->dev->kc;
+	struct fo_kent *ent;
+	struct fo_rhdr h;
+	char *p;
+
+	rdr->snaplen = 0;
+	list_for_each_entry(ent, &kc->lru, lru) {
+		if (ent->h.seq >= minseq)
+			rdr->snaplen += FO_RHDR_SIZE + ent->h.len;
+	}
+	if (rdr->snaplen == 0)
+		return 0;
+	rdr->snap = kvmalloc(rdr->snaplen, GFP_KERNEL);
+	if (!rdr->snap)
+		return -ENOMEM;
+	rdr->snapoff = 0;
+
+	p = rdr->snap;
+	list_for_each_entry(ent, &kc->lru, lru) {
+		if (ent->h.seq < minseq)
+			continue;
+		h = ent->h;
+		h.flags |= flag;
+		memcpy(p, &h, FO_RHDR_SIZE);
+		memcpy(p + FO_RHDR_SIZE, ent->data, ent->h.len);
+		p += FO_RHDR_SIZE + ent->h.len;
+	}
+	return 0;
+}
+
+
+/* Read the next record of a reader's snapshot.  The snapshot is
+ * freed after its last record.  Called with dev->sem held. */
+static ssize_t fo_read_snap(struct fo_reader *rdr, char __user *buff,
+			    size_t count)
+{
+	struct fo_rhdr h;
+	int hlen;
+
+	memcpy(&h, rdr->snap + rdr->snapoff, FO_RHDR_SIZE);
+	hlen = (rdr->flags & FO_RF_HDR) ? sizeof(struct fo_rec) : 0;
+	if (hlen + h.len > count)
+		return -EMSGSIZE;
+	if (fo_hdr_to_user(rdr, buff, &h) < 0)
+		return -EFAULT;
+	if (copy_to_user(buff + hlen, rdr->snap + rdr->snapoff + FO_RHDR_SIZE,
+			h.len))
+		return -EFAULT;
+
+	rdr->snapoff += FO_RHDR_SIZE + h.len;
+	if (rdr->snapoff == rdr->snaplen) {
+		kvfree(rdr->snap);
+		rdr->snap = NULL;
+	}
+	rdr->bytes += hlen + h.len;
+	rdr->lastread = ktime_get_ns();
+	return hlen + h.len;
+}
+
+
+/* Should a sampling reader skip the record with header h.  It gets
+ * every severy'th record, and none sooner than sint after the last
+ * one it got, going by publish times.  Called with dev->sem held. */
+static int fo_sample_skip(struct fo_reader *rdr, struct fo_rhdr *h)
+{
+	if (rdr->scount) {
+		rdr->scount--;
+		return 1;
+	}
+	if (rdr->sint && rdr->slast && (h->ns - rdr->slast < rdr->sint))
+		return 1;
+	return 0;
+}
+
+
+/* Should the reader step over the record with header h at off,
+ * because it filters it out, it is too old, or it is not sampled.
+ * Counts the reason.  Called with dev->sem held. */
+static int fo_rec_skip(struct fo_reader *rdr, struct fo_rhdr *h, loff_t off)
+{
+	if ((rdr->tagged && !FO_TAG_ISSET(rdr->tmask, h->tag)) ||
+			(rdr->filter && !fo_filt_match(rdr, off))) {
+		rdr->filtered++;
+		return 1;
+	}
+	if (rdr->maxage && (ktime_get_ns() - h->ns > rdr->maxage)) {
+		rdr->stale++;
+		return 1;
+	}
+	if ((rdr->sint || rdr->severy) && fo_sample_skip(rdr, h)) {
+		rdr->sampled++;
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Put an urgent record in the next slot of the urgent lane,
+ * overwriting the oldest.  It is copied in to a staging slot past
+ * the end of the lane first, so a fault leaves the oldest record
+ * whole for a reader that is behind.  Called with dev->sem held.
+ * Returns the record size or an error. */
+static int fo_prio_put(struct fo *dev, const char __user *buff,
+		       size_t count)
+{
+	struct fo_pslot *ps;
+
+	if (count == 0)
+		return 0;	/* would read as end of file */
+	if (count > FO_PRIO_MAX)
+		return -EMSGSIZE;
+	if (!dev->prio) {
+		dev->prio = kmalloc_array(FO_PRIO_SLOTS + 1,
+				sizeof(struct fo_pslot), GFP_KERNEL);
+		if (!dev->prio)
+			return -ENOMEM;
+	}
+	if (copy_from_user(dev->prio[FO_PRIO_SLOTS].data, buff, count))
+		return -EFAULT;
+	ps = &dev->prio[dev->pcount & (FO_PRIO_SLOTS - 1)];
+	memcpy(ps->data, dev->prio[FO_PRIO_SLOTS].data, count);
+	ps->h.len = count;
+	ps->h.flags = FO_REC_PRIO;
+	ps->h.tag = 0;
+	ps->h.pad = 0;
+	ps->h.seq = dev->pcount;
+	ps->h.ns = ktime_get_ns();
+	ps->h.gseq = 0;
+	dev->pcount++;
+	return count;
+}
+
+
+/* Give the reader its oldest unread urgent record.  A reader that
+ * fell a whole lane behind loses the oldest ones, as counted in
+ * ulost.  Called with dev->sem held and an urgent record pending. */
+static ssize_t fo_read_prio(struct fo_reader *rdr, char __user *buff,
+			    size_t count)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_pslot *ps;
+	int hlen;
+
+	if (dev->pcount - rdr->ppos > FO_PRIO_SLOTS) {
+		rdr->ulost += dev->pcount - rdr->ppos - FO_PRIO_SLOTS;
+		rdr->ppos = dev->pcount - FO_PRIO_SLOTS;
+	}
+	ps = &dev->prio[rdr->ppos & (FO_PRIO_SLOTS - 1)];
+	hlen = (rdr->flags & FO_RF_HDR) ? sizeof(struct fo_rec) : 0;
+	if (hlen + ps->h.len > count)
+		return -EMSGSIZE;
+	if (fo_hdr_to_user(rdr, buff, &ps->h) < 0)
+		return -EFAULT;
+	if (copy_to_user(buff + hlen, ps->data, ps->h.len))
+		return -EFAULT;
+	rdr->ppos++;
+	rdr->bytes += hlen + ps->h.len;
+	rdr->lastread = ktime_get_ns();
+	return hlen + ps->h.len;
+}
+
+
+/* Add a record to the writer's open transaction.  It gets its
+ * sequence number and time when the transaction commits.  Returns
+ * the record size or an error.  Called with dev->sem held. */
+static int fo_tx_put(struct fo_reader *rdr, const char __user *buff,
+		     size_t count)
+{
+	struct fo_rhdr h;
+	char *tx;
+	int size;
+
+	if (count == 0)
+		return 0;	/* would read as end of file */
+	if (count > fo_maxwrite(rdr->dev))
+		return -EMSGSIZE;
+	if (rdr->txlen + FO_RHDR_SIZE + count > buffersize / 2)
+		return -ENOBUFS;
+	if (rdr->txlen + FO_RHDR_SIZE + count > rdr->txsize) {
+		size = rdr->txsize;
+		while (size < rdr->txlen + FO_RHDR_SIZE + count)
+			size *= 2;
+		size = min(size, buffersize / 2);
+		tx = kvmalloc(size, GFP_KERNEL);
+		if (!tx)
+			return -ENOMEM;
+		memcpy(tx, rdr->tx, rdr->txlen);
+		kvfree(rdr->tx);
+		rdr->tx = tx;
+		rdr->txsize = size;
+	}
+	if (copy_from_user(rdr->tx + rdr->txlen + FO_RHDR_SIZE, buff, count))
+		return -EFAULT;
+	memset(&h, 0, sizeof(h));
+	h.len = count;
+	h.flags = rdr->syncnext ? FO_REC_SYNC : 0;
+	h.tag = rdr->tag;
+	memcpy(rdr->tx + rdr->txlen, &h, FO_RHDR_SIZE);
+	rdr->txlen += FO_RHDR_SIZE + count;
+	rdr->syncnext = 0;
+	return count;
+}
+
+
+/* Commit the writer's open transaction.  Its records go in the
+ * buffer together and readers see them all at once, with one advance
+ * of dev->count and one wakeup.  Returns the number of records.
+ * Called with dev->sem held. */
+static int fo_tx_commit(struct fo_reader *rdr)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_rhdr h;
+	loff_t start, at;
+	int off, n = 0;
+	u64 gseq;
+
+	if (!rdr->tx || (dev->mode != FO_MODE_FRAMED))
+		return -EINVAL;
+	for (off = 0; off < rdr->txlen; off += FO_RHDR_SIZE + h.len) {
+		memcpy(&h, rdr->tx + off, FO_RHDR_SIZE);
+		n++;
+	}
+	gseq = fo_gseq_take(dev, n);
+	start = dev->count;
+	at = start;
+	for (off = 0; off < rdr->txlen; off += FO_RHDR_SIZE + h.len) {
+		memcpy(&h, rdr->tx + off, FO_RHDR_SIZE);
+		fo_rec_putk(dev, at, rdr->tx + off + FO_RHDR_SIZE, h.len,
+				h.flags, h.tag, gseq ? gseq++ : 0);
+		if (h.flags & FO_REC_SYNC)
+			dev->lastsync = at;
+		if (dev->kc)
+			fo_kc_update(dev, at);
+		at += FO_RHDR_SIZE + h.len;
+	}
+	kvfree(rdr->tx);
+	rdr->tx = NULL;
+
+	if (n) {
+		fo_commit(dev, at - start);
+		trace_fanout_write_commit(dev->minor, at - start, dev->count);
+		if (fo_published(dev, start))
+			wake_up_interruptible(&dev->inq);
+	}
+	return n;
+}
+
+
+/* FO_IOC_SENDMMSG:  write many framed records under one hold of
+ * the semaphore and commit them together.  Writing stops at the
+ * first record that fails.  Returns how many were written, or the
+ * error of the first record. */
+static long fo_send_batch(struct file *filp, unsigned long arg)
+{
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
+	struct fo_mmsg __user *umsgs;
+	struct fo_mmsg *msgs, *m;
+	struct fo_msend ms;
+	loff_t start, at;
+	u64 gseq;
+	int wake = 0;
+	int err = 0;
+	int n = 0;
+	int i, ret;
+
+	if (copy_from_user(&ms, (void __user *) arg, sizeof(ms)))
+		return -EFAULT;
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EPERM;
+	if (ms.vlen == 0)
+		return 0;
+	if (ms.vlen > FO_MMSG_MAX)
+		return -EINVAL;
+	umsgs = u64_to_user_ptr(ms.msgs);
+	msgs = memdup_user(umsgs, ms.vlen * sizeof(struct fo_mmsg));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	if (down_interruptible(&dev->sem)) {
+		kfree(msgs);
+		return -ERESTARTSYS;
+	}
+	if (dev->mode != FO_MODE_FRAMED) {
+		up(&dev->sem);
+		kfree(msgs);
+		return -EINVAL;
+	}
+	start = dev->count;
+	at = start;
+	trace_fanout_write_start(dev->minor, ms.vlen, dev->count);
+
+	/* Number the records that fit, before writing any */
+	for (i = 0; i < ms.vlen; i++) {
+		m = &msgs[i];
+		if (m->len == 0)
+			continue;
+		if ((m->len > fo_maxwrite(dev)) ||
+				(at + FO_RHDR_SIZE + m->len - start >
+				 buffersize / 2))
+			break;
+		at += FO_RHDR_SIZE + m->len;
+		n++;
+	}
+	gseq = fo_gseq_take(dev, n);
+	at = start;
+	n = 0;
+
+	for (i = 0; i < ms.vlen; i++) {
+		m = &msgs[i];
+		if (err) {
+			m->result = -ECANCELED;
+			continue;
+		}
+		if (m->len == 0) {
+			m->result = 0;	/* would read as end of file */
+			continue;
+		}
+		/* A batch is committed whole, so it may not overwrite
+		 * itself before a reader sees it */
+		if (m->len > fo_maxwrite(dev))
+			err = -EMSGSIZE;
+		else if (at + FO_RHDR_SIZE + m->len - start > buffersize / 2)
+			err = -ENOBUFS;
+		else
+			err = fo_rec_put(dev, at, u64_to_user_ptr(m->data),
+					m->len, (rdr->syncnext && !n) ?
+					FO_REC_SYNC : 0, (m->flags & FO_MF_TAG) ?
+					m->tag : rdr->tag, gseq ? gseq + n : 0);
+		if (err < 0) {
+			m->result = err;
+			continue;
+		}
+		err = 0;
+		if (dev->kc)
+			fo_kc_update(dev, at);
+		at += FO_RHDR_SIZE + m->len;
+		m->result = m->len;
+		n++;
+	}
+
+	if (n) {
+		fo_commit(dev, at - start);
+		wake = fo_published(dev, start);
+		if (rdr->syncnext) {
+			dev->lastsync = start;
+			rdr->syncnext = 0;
+		}
+	}
+	trace_fanout_write_commit(dev->minor, at - start, dev->count);
+	up(&dev->sem);
+
+	if (wake)
+		wake_up_interruptible(&dev->inq);
+
+	ret = copy_to_user(umsgs, msgs, ms.vlen * sizeof(struct fo_mmsg)) ?
+			-EFAULT : 0;
+	kfree(msgs);
+	if (n)
+		return n;
+	return err ? err : ret;
+}
+
+
+/* Give one record to a batched receive as descriptor n, its data
+ * at used in the payload buffer.  The data comes from kdata, or from
+ * the ring at off if kdata is NULL.  Returns the payload bytes used,
+ * -EMSGSIZE if it does not fit, or -EFAULT. */
+static int fo_mrec_put(struct fo_reader *rdr, struct fo_mrecv *mr, int n,
+		       size_t used, struct fo_rhdr *h, const void *kdata,
+		       loff_t off)
+{
+	char __user *to = (char __user *) u64_to_user_ptr(mr->buf) + used;
+	struct fo_mdesc __user *dp = u64_to_user_ptr(mr->descs);
+	struct fo_mdesc d;
+
+	if (h->len > mr->buflen - used)
+		return -EMSGSIZE;
+	memset(&d, 0, sizeof(d));
+	d.off = used;
+	d.rec.len = h->len;
+	d.rec.flags = h->flags;
+	d.rec.tag = h->tag;
+	d.rec.seq = h->seq;
+	d.rec.ns = h->ns;
+	d.rec.gseq = h->gseq;
+	if (kdata ? copy_to_user(to, kdata, h->len) :
+			fo_ring_to_user(rdr->dev, to, off, h->len))
+		return -EFAULT;
+	if (copy_to_user(dp + n, &d, sizeof(d)))
+		return -EFAULT;
+	return h->len;
+}
+
+
+/* Read records for a batched receive until the descriptors run out
+ * or none is left, in the same order and with the same skipping as
+ * read().  n and used count the records and payload bytes so far.
+ * Returns 0 if it ran out of records, else the error that stopped
+ * it.  Called with dev->sem held. */
+static int fo_recv_some(struct fo_reader *rdr, struct file *filp,
+			struct fo_mrecv *mr, int *n, size_t *used, int lattype)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_pslot *ps;
+	struct fo_rhdr h;
+	loff_t pos;
+	int skip;
+	int ret;
+
+	while (*n < mr->vlen) {
+		if (rdr->ppos != dev->pcount) {
+			if (dev->pcount - rdr->ppos > FO_PRIO_SLOTS) {
+				rdr->ulost += dev->pcount - rdr->ppos -
+						FO_PRIO_SLOTS;
+				rdr->ppos = dev->pcount - FO_PRIO_SLOTS;
+			}
+			ps = &dev->prio[rdr->ppos & (FO_PRIO_SLOTS - 1)];
+			ret = fo_mrec_put(rdr, mr, *n, *used, &ps->h,
+					ps->data, 0);
+			if (ret < 0)
+				return ret;
+			rdr->ppos++;
+		} else if (rdr->snap) {
+			memcpy(&h, rdr->snap + rdr->snapoff, FO_RHDR_SIZE);
+			ret = fo_mrec_put(rdr, mr, *n, *used, &h,
+					rdr->snap + rdr->snapoff + FO_RHDR_SIZE,
+					0);
+			if (ret < 0)
+				return ret;
+			rdr->snapoff += FO_RHDR_SIZE + h.len;
+			if (rdr->snapoff == rdr->snaplen) {
+				kvfree(rdr->snap);
+				rdr->snap = NULL;
+			}
+		} else {
+			pos = filp->f_pos;
+			if (pos == dev->count)
+				return 0;
+			if (rdr->conflate && dev->kc &&
+					((pos < fo_oldest(dev)) ||
+					 (dev->count - pos > rdr->conflate))) {
+				ret = fo_kc_snapshot(rdr, rdr->nextseq,
+						FO_REC_CONFL);
+				if (ret < 0)
+					return ret;
+				fo_setpos(rdr, filp, dev->count);
+				continue;
+			}
+			if ((pos < fo_oldest(dev)) || (pos > dev->count)) {
+				/* reported by itself, on the next call if
+				 * this one already has records */
+				if (*n)
+					return -EPIPE;
+				trace_fanout_overrun(dev->minor, pos,
+						dev->count);
+				rdr->overruns++;
+				if (rdr->flags & FO_RF_SYNC)
+					fo_setpos(rdr, filp, fo_syncpos(dev));
+				return -EPIPE;
+			}
+			if ((pos != rdr->pos) && !fo_is_rec(dev, pos))
+				return -EINVAL;
+
+			fo_ring_get(dev, &h, pos, FO_RHDR_SIZE);
+			skip = fo_rec_skip(rdr, &h, pos);
+			if (!skip) {
+				ret = fo_mrec_put(rdr, mr, *n, *used, &h, NULL,
+						pos + FO_RHDR_SIZE);
+				if (ret < 0)
+					return ret;
+				rdr->scount = rdr->severy ? rdr->severy - 1 : 0;
+				rdr->slast = h.ns;
+				fo_lat_record(dev, pos, lattype);
+			}
+			filp->f_pos = pos + FO_RHDR_SIZE + h.len;
+			rdr->pos = filp->f_pos;
+			rdr->nextseq = h.seq + 1;
+			if (skip)
+				continue;
+		}
+		*used += ret;
+		rdr->bytes += ret;
+		rdr->lastread = ktime_get_ns();
+		(*n)++;
+	}
+	return 0;
+}
+
+
+/* FO_IOC_RECVMMSG:  read many records at once.  Returns how many,
+ * or an error if there were none. */
+static long fo_recv_batch(struct file *filp, unsigned long arg)
+{
+	struct fo_reader *rdr = filp->private_data;
+	struct fo *dev = rdr->dev;
+	struct fo_mrecv mr;
+	int lattype = FO_LAT_READY;
+	size_t used = 0;
+	long left;		/* jiffies left to wait */
+	int n = 0;
+	int want;
+	int ret;
+
+	if (copy_from_user(&mr, (void __user *) arg, sizeof(mr)))
+		return -EFAULT;
+	if (!(filp->f_mode & FMODE_READ))
+		return -EPERM;
+	if (mr.vlen == 0)
+		return 0;
+	mr.vlen = min_t(__u32, mr.vlen, INT_MAX);
+	mr.buflen = min_t(__u64, mr.buflen, U32_MAX);
+	want = mr.min ? min(mr.min, mr.vlen) : 1;
+	left = mr.timeout ? max_t(long, nsecs_to_jiffies(mr.timeout), 1) :
+			MAX_SCHEDULE_TIMEOUT;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if ((dev->mode != FO_MODE_FRAMED) || rdr->grp) {
+		up(&dev->sem);
+		return -EINVAL;
+	}
+
+	for (;;) {
+		ret = fo_recv_some(rdr, filp, &mr, &n, &used, lattype);
+		if (ret || (n >= want) || (left == 0))
+			break;
+
+		/* Wait as read() does, but no longer than the timeout */
+		trace_fanout_read_wait(dev->minor, filp->f_pos, dev->count);
+		rdr->fready = 0;
+		if (!rdr->filter)
+			fo_tag_want(rdr);
+		up(&dev->sem);
+		if (rdr->filter)
+			left = wait_event_interruptible_timeout(rdr->wq,
+					rdr->fready ||
+					(rdr->ppos != dev->pcount), left);
+		else
+			left = wait_event_interruptible_timeout(dev->inq,
+					(filp->f_pos != dev->count) ||
+					(rdr->ppos != dev->pcount), left);
+		if (left < 0)
+			return n ? n : -ERESTARTSYS;
+		if (down_interruptible(&dev->sem))
+			return n ? n : -ERESTARTSYS;
+		trace_fanout_read_wake(dev->minor, filp->f_pos, dev->count);
+		lattype = FO_LAT_WOKEN;
+	}
+	trace_fanout_read(dev->minor, used, filp->f_pos, dev->count);
+	up(&dev->sem);
+
+	return n ? n : ret;
+}
+
+
+/* Join the reader to the named group, creating the group at the
+ * head if it is new, or leave its group if the name is empty.
+ * Called with dev->sem held. */
+static int fo_grp_join(struct fo_reader *rdr, struct fo_groupcfg *cfg)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_group *grp, *found = NULL;
+	int ngroups = 0;
+
+	cfg->name[FO_GROUPNAME - 1] = 0;
+	if (cfg->name[0] && ((dev->mode != FO_MODE_FRAMED) ||
+			(cfg->keylen > FO_MAXKEY)))
+		return -EINVAL;
+
+	list_for_each_entry(grp, &dev->groups, list) {
+		if (!strcmp(grp->name, cfg->name))
+			found = grp;
+		ngroups++;
+	}
+	if (found && (found->keylen != cfg->keylen))
+		return -EINVAL;	/* every member must pick the same way */
+	if (found && (found == rdr->grp))
+		return 0;
+	if (cfg->name[0] && !found && (ngroups >= FO_MAXGROUPS))
+		return -ENOSPC;
+
+	if (rdr->grp)
+		fo_grp_leave(rdr);
+	if (!cfg->name[0])
+		return 0;
+
+	if (!found) {
+		found = kzalloc(sizeof(struct fo_group), GFP_KERNEL);
+		if (!found)
+			return -ENOMEM;
+		strscpy(found->name, cfg->name, FO_GROUPNAME);
+		found->keylen = cfg->keylen;
+		found->pos = dev->count;
+		INIT_LIST_HEAD(&found->members);
+		init_waitqueue_head(&found->wq);
+		list_add_tail(&found->list, &dev->groups);
+	}
+	rdr->grp = found;
+	rdr->gid = found->nextid++;
+	list_add_tail(&rdr->gnode, &found->members);
+	found->nmembers++;
+	rdr->pos = found->pos;
+	fo_grp_wake(dev, found);	/* members may now hash elsewhere */
+	return 0;
+}
+
+
+/* Take the reader out of its group.  It goes back to reading every
+ * record, starting at the head.  Called with dev->sem held. */
+static void fo_grp_leave(struct fo_reader *rdr)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_group *grp = rdr->grp;
+
+	list_del_init(&rdr->gnode);
+	grp->nmembers--;
+	rdr->grp = NULL;
+	rdr->pos = dev->count;
+	rdr->nextseq = dev->nrec;
+	rdr->ppos = dev->pcount;
+	fo_grp_wake(dev, grp);
+	wake_up_interruptible_all(&grp->wq);	/* in case rdr waits */
+	wake_up_interruptible(&rdr->wq);
+}
+
+
+/* Catch the group cursor up with the oldest record if it was
+ * overrun, work out who gets the record at it, and wake that
+ * member, or one idle member of a round robin group.  A key goes to
+ * the member that scores highest for it, so a join or leave moves
+ * only the keys of that member, not nearly all of them as a hash
+ * modulo the member count would.  Called with dev->sem held after
+ * anything that changes these. */
+static void fo_grp_wake(struct fo *dev, struct fo_group *grp)
+{
+	struct fo_reader *rdr;
+	char key[FO_MAXKEY];
+	struct fo_rhdr h;
+	int klen;
+	u32 hash, score, best = 0;
+
+	if (grp->pos < dev->tail) {
+		grp->lost += dev->tail - grp->pos;
+		grp->pos = dev->tail;
+	}
+	grp->owner = NULL;
+	if ((grp->pos == dev->count) || !grp->nmembers)
+		return;
+	if (!grp->keylen) {
+		wake_up_interruptible(&grp->wq);	/* just one of them */
+		return;
+	}
+
+	fo_ring_get(dev, &h, grp->pos, FO_RHDR_SIZE);
+	klen = min_t(int, h.len, grp->keylen);
+	fo_ring_get(dev, key, grp->pos + FO_RHDR_SIZE, klen);
+	hash = jhash(key, klen, 0);
+	list_for_each_entry(rdr, &grp->members, gnode) {
+		score = jhash_2words(hash, rdr->gid, 0);
+		if (!grp->owner || (score > best)) {
+			grp->owner = rdr;
+			best = score;
+		}
+	}
+	wake_up_interruptible(&grp->owner->wq);
+}
+
+
+/* Is a member of any group of the device asleep in a read?  The
+ * groups must not be freed under it.  Called with dev->sem held. */
+static int fo_grp_busy(struct fo *dev)
+{
+	struct fo_group *grp;
+
+	list_for_each_entry(grp, &dev->groups, list) {
+		if (grp->nwait)
+			return 1;
+	}
+	return 0;
+}
+
+
+/* Free all consumer groups of a device.  Any members must have
+ * left already, and none be waiting; see fo_grp_busy().  Called
+ * with dev->sem held, or at unload. */
+static void fo_grp_free(struct fo *dev)
+{
+	struct fo_group *grp, *tmp;
+
+	list_for_each_entry_safe(grp, tmp, &dev->groups, list) {
+		list_del(&grp->list);
+		kfree(grp);
+	}
+}
+
+
+/* Is the record at the group cursor there and for this member.
+ * This is also the wait condition, so it runs without the lock. */
+static int fo_grp_mine(struct fo_reader *rdr, struct fo_group *grp)
+{
+	return (rdr->grp != grp) || ((grp->pos != rdr->dev->count) &&
+			(!grp->keylen || (grp->owner == rdr)));
+}
+
+
+/* Read for a member of a consumer group: wait until the record at
+ * the group cursor is ours, take it, and pass the cursor on.  Called
+ * with dev->sem held, which is released. */
+static ssize_t fo_read_group(struct fo_reader *rdr, char __user *buff,
+			     size_t count)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_group *grp = rdr->grp;
+	struct fo_rhdr h;
+	int lattype = FO_LAT_READY;	/* did we have to wait for it */
+	int hlen, ret;
+
+	while (!fo_grp_mine(rdr, grp)) {
+		grp->nwait++;		/* keeps grp from being freed */
+		up(&dev->sem);
+		if (grp->keylen)
+			ret = wait_event_interruptible(rdr->wq,
+					fo_grp_mine(rdr, grp));
+		else
+			ret = wait_event_interruptible_exclusive(grp->wq,
+					fo_grp_mine(rdr, grp));
+		down(&dev->sem);	/* to let go of grp */
+		grp->nwait--;
+		if (ret) {
+			up(&dev->sem);
+			return -ERESTARTSYS;
+		}
+		lattype = FO_LAT_WOKEN;
+	}
+	if (rdr->grp != grp) {
+		up(&dev->sem);
+		return -EINTR;	/* left the group while waiting */
+	}
+
+	fo_ring_get(dev, &h, grp->pos, FO_RHDR_SIZE);
+	hlen = (rdr->flags & FO_RF_HDR) ? sizeof(struct fo_rec) : 0;
+	if (hlen + h.len > count) {
+		up(&dev->sem);
+		return -EMSGSIZE;
+	}
+	if ((fo_hdr_to_user(rdr, buff, &h) < 0) ||
+			fo_ring_to_user(dev, buff + hlen,
+				grp->pos + FO_RHDR_SIZE, h.len)) {
+		up(&dev->sem);
+		return -EFAULT;
+	}
+	fo_lat_record(dev, grp->pos, lattype);
+	grp->pos += FO_RHDR_SIZE + h.len;
+	rdr->pos = grp->pos;
+	rdr->nextseq = h.seq + 1;
+	ret = hlen + h.len;
+	rdr->bytes += ret;
+	rdr->lastread = ktime_get_ns();
+	fo_grp_wake(dev, grp);		/* the next record, if any */
+	trace_fanout_read(dev->minor, ret, grp->pos, dev->count);
+	up(&dev->sem);
+
+	return ret;
+}
+
+
+/* Filter programs see a struct fo_filtctx, not a packet.  As with
+ * seccomp, the only data loads allowed are aligned words, which are
+ * turned into loads from the context; BPF_LEN becomes its size. */
+static int fo_filt_check(struct sock_filter *filter, unsigned int flen)
+{
+	struct sock_filter *ins;
+	int i;
+
+	for (i = 0; i < flen; i++) {
+		ins = &filter[i];
+		switch (ins->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+			if ((ins->k >= sizeof(struct fo_filtctx)) ||
+					(ins->k & 3))
+				return -EINVAL;
+			ins->code = BPF_LDX | BPF_W | BPF_ABS;
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			ins->code = BPF_LD | BPF_IMM;
+			ins->k = sizeof(struct fo_filtctx);
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			ins->code = BPF_LDX | BPF_IMM;
+			ins->k = sizeof(struct fo_filtctx);
+			break;
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+		case BPF_LDX | BPF_B | BPF_MSH:
+			return -EINVAL;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/* Attach the user's classic BPF program to the reader in place of
+ * any it had, or just drop the old one if the new is empty.  Called
+ * with dev->sem held. */
+static int fo_filt_set(struct fo_reader *rdr, struct fo_filter *f)
+{
+	struct fo *dev = rdr->dev;
+	struct sock_fprog fprog;
+	struct bpf_prog *prog;
+	int ret;
+
+	if (!f->len) {
+		fo_filt_drop(rdr);
+		return 0;
+	}
+	if ((dev->mode != FO_MODE_FRAMED) || (f->len > BPF_MAXINSNS))
+		return -EINVAL;
+
+	fprog.len = f->len;
+	fprog.filter = u64_to_user_ptr(f->insns);
+	ret = bpf_prog_create_from_user(&prog, &fprog, fo_filt_check, false);
+	if (ret)
+		return ret;
+	fo_filt_drop(rdr);
+	rdr->filter = prog;
+	rdr->fready = 1;	/* look at what is already buffered */
+	dev->nfilt++;
+	return 0;
+}
+
+
+/* Take the filter off the reader, and wake it in case it was waiting
+ * for a match.  Called with dev->sem held. */
+static void fo_filt_drop(struct fo_reader *rdr)
+{
+	if (!rdr->filter)
+		return;
+	bpf_prog_destroy(rdr->filter);
+	rdr->filter = NULL;
+	rdr->dev->nfilt--;
+	rdr->fready = 1;
+	wake_up_interruptible(&rdr->wq);
+}
+
+
+/* What the filter programs see of the record at stream offset off */
+static void fo_filt_ctx(struct fo *dev, loff_t off, struct fo_filtctx *ctx)
+{
+	struct fo_rhdr h;
+
+	fo_ring_get(dev, &h, off, FO_RHDR_SIZE);
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->len = h.len;
+	ctx->flags = h.flags;
+	ctx->tag = h.tag;
+	ctx->seq = h.seq;
+	ctx->ns = h.ns;
+	fo_ring_get(dev, ctx->data, off + FO_RHDR_SIZE,
+			min_t(int, h.len, FO_FILTWIN));
+}
+
+
+/* Does the record at off pass the reader's filter.  Like seccomp we
+ * run the program from process context, so keep it on one CPU. */
+static int fo_filt_match(struct fo_reader *rdr, loff_t off)
+{
+	struct fo_filtctx ctx;
+
+	fo_filt_ctx(rdr->dev, off, &ctx);
+	return bpf_prog_run_pin_on_cpu(rdr->filter, &ctx) != 0;
+}
+
+
+/* Has a filtered reader a record to read:  one past its position
+ * that passes its filter and tag mask, a snapshot, or an overrun to
+ * hear about.  If not, clear fready so that the writer wakes it for
+ * the next match.  Called from poll with dev->sem held. */
+static int fo_filt_pending(struct fo_reader *rdr, struct file *filp)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_rhdr h;
+	loff_t p;
+
+	if (rdr->snap || (filp->f_pos < fo_oldest(dev)))
+		return 1;
+	if (!rdr->fready)
+		return 0;	/* nothing matched since the last look */
+	for (p = filp->f_pos; p < dev->count; p += FO_RHDR_SIZE + h.len) {
+		fo_ring_get(dev, &h, p, FO_RHDR_SIZE);
+		if ((!rdr->tagged || FO_TAG_ISSET(rdr->tmask, h.tag)) &&
+				fo_filt_match(rdr, p))
+			return 1;
+	}
+	rdr->fready = 0;
+	return 0;
+}
+
+
+/* A record was written at off, or an urgent record if off is
+ * negative.  Wake the filtered readers that want it and are not
+ * already awake.  Called by the writer with dev->sem held. */
+static void fo_filt_wake(struct fo *dev, loff_t off)
+{
+	struct fo_filtctx ctx;
+	struct fo_reader *rdr;
+	int have_ctx = 0;
+
+	list_for_each_entry(rdr, &dev->readers, list) {
+		if (!rdr->filter || rdr->grp)
+			continue;
+		if (off < 0) {
+			wake_up_interruptible(&rdr->wq);
+			continue;
+		}
+		if (rdr->fready)
+			continue;
+		if (!have_ctx) {
+			fo_filt_ctx(dev, off, &ctx);
+			have_ctx = 1;
+		}
+		if (rdr->tagged && !FO_TAG_ISSET(rdr->tmask, ctx.tag))
+			continue;
+		if (bpf_prog_run_pin_on_cpu(rdr->filter, &ctx)) {
+			rdr->fready = 1;
+			wake_up_interruptible(&rdr->wq);
+		}
+	}
+}
+
+
+/* A reader is about to sleep on dev->inq, or poll it.  Add the tags
+ * it wants to those the writer wakes the queue for. */
+static void fo_tag_want(struct fo_reader *rdr)
+{
+	int i;
+
+	for (i = 0; i < FO_NTAGS / 64; i++)
+		atomic64_or(rdr->tmask[i], &rdr->dev->wmask[i]);
+	smp_mb();	/* before the caller looks at dev->count again */
+}
+
+
+/* Does a reader on dev->inq want a record with this tag.  If so all
+ * of them are about to be woken, and those that sleep again will say
+ * again what they want.  Called by the writer after the commit. */
+static int fo_tag_wanted(struct fo *dev, int tag)
+{
+	int i;
+
+	smp_mb();	/* the new dev->count is seen by whoever we miss */
+	if (!(atomic64_read(&dev->wmask[tag / 64]) & (1ULL << (tag % 64))))
+		return 0;
+	for (i = 0; i < FO_NTAGS / 64; i++)
+		atomic64_set(&dev->wmask[i], 0);
+	return 1;
+}
+
+
+/* Length of the first level of a topic name or pattern */
+static int fo_level_len(const char *s)
+{
+	const char *e = strchr(s, '/');
+
+	return e ? (e - s) : strlen(s);
+}
+
+
+/* Is the name or pattern made of non-empty levels separated by single
+ * slashes.  A pattern may have * levels and a final ** level. */
+static int fo_name_ok(const char *s, int pattern)
+{
+	int n;
+
+	for (;;) {
+		n = fo_level_len(s);
+		if (n == 0)
+			return 0;
+		if (memchr(s, '*', n)) {
+			if (!pattern)
+				return 0;
+			if (!((n == 1) || ((n == 2) && (s[1] == '*') &&
+					!s[2])))
+				return 0;
+		}
+		if (!s[n])
+			return 1;
+		s += n + 1;
+	}
+}
+
+
+/* Does the topic name match the pattern.  * is any one level, a
+ * final ** is one or more levels. */
+static int fo_name_match(const char *pat, const char *name)
+{
+	int pn, nn;
+
+	for (;;) {
+		pn = fo_level_len(pat);
+		nn = fo_level_len(name);
+		if ((pn == 2) && !strncmp(pat, "**", 2))
+			return 1;
+		if (!((pn == 1) && (*pat == '*')) &&
+				((pn != nn) || strncmp(pat, name, pn)))
+			return 0;
+		pat += pn;
+		name += nn;
+		if (!*pat || !*name)
+			return !*pat && !*name;
+		pat++;
+		name++;
+	}
+}
+
+
+/* Find the trie node of a topic name, making it and the levels above
+ * it if create is set.  Called with fo_names_lock held. */
+static struct fo_tnode *fo_trie_find(const char *name, int create)
+{
+	struct fo_tnode *node, *kid, *found;
+	int n;
+
+	if (!fo_troot && create) {
+		fo_troot = kzalloc(sizeof(struct fo_tnode) + 1, GFP_KERNEL);
+		if (!fo_troot)
+			return NULL;
+		INIT_LIST_HEAD(&fo_troot->kids);
+		fo_troot->minor = -1;
+	}
+	node = fo_troot;
+	while (node && *name) {
+		n = fo_level_len(name);
+		found = NULL;
+		list_for_each_entry(kid, &node->kids, sibs) {
+			if (!strncmp(kid->name, name, n) && !kid->name[n]) {
+				found = kid;
+				break;
+			}
+		}
+		if (!found && create) {
+			found = kzalloc(sizeof(struct fo_tnode) + n + 1,
+					GFP_KERNEL);
+			if (!found)
+				return NULL;
+			memcpy(found->name, name, n);
+			INIT_LIST_HEAD(&found->kids);
+			found->parent = node;
+			found->minor = -1;
+			list_add_tail(&found->sibs, &node->kids);
+		}
+		node = found;
+		name += name[n] ? n + 1 : n;
+	}
+	return node;
+}
+
+
+/* Free nodes that no longer name a topic or lead to one */
+static void fo_trie_prune(struct fo_tnode *node)
+{
+	struct fo_tnode *up;
+
+	while (node->parent && (node->minor < 0) &&
+			list_empty(&node->kids)) {
+		up = node->parent;
+		list_del(&node->sibs);
+		kfree(node);
+		node = up;
+	}
+}
+
+
+/* Free a whole trie, at unload */
+static void fo_trie_free(struct fo_tnode *node)
+{
+	struct fo_tnode *kid, *tmp;
+
+	if (!node)
+		return;
+	list_for_each_entry_safe(kid, tmp, &node->kids, sibs)
+		fo_trie_free(kid);
+	kfree(node);
+}
+
+
+/* Add a topic to a subscription, reading from its head, unless it is
+ * there already.  Called with sub->lock held. */
+static int fo_sub_add(struct fo_sub *sub, struct fo *dev)
+{
+	struct fo_subt *st;
+
+	list_for_each_entry(st, &sub->topics, snode) {
+		if (st->dev == dev)
+			return 0;
+	}
+	st = kzalloc(sizeof(struct fo_subt), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	st->sub = sub;
+	st->dev = dev;
+	st->stale = 1;
+	down(&dev->sem);
+	st->pos = dev->count;
+	list_add_tail(&st->dnode, &dev->subs);
+	up(&dev->sem);
+	list_add_tail(&st->snode, &sub->topics);
+	sub->ntopics++;
+	return 0;
+}
+
+
+/* The fanout device that file descriptor fd is open on.  A file
+ * open with mode shows the caller passed the permission check on the
+ * topic's node, which the control device cannot make for it. */
+static struct fo *fo_fd_dev(int fd, fmode_t mode)
+{
+	struct fo_reader *rdr;
+	struct file *f;
+	struct fo *dev;
+
+	f = fget(fd);
+	if (!f)
+		return ERR_PTR(-EBADF);
+	if (f->f_op != &fanout_fops) {
+		dev = ERR_PTR(-EINVAL);	/* not a topic */
+	} else if ((f->f_mode & mode) != mode) {
+		dev = ERR_PTR(-EBADF);
+	} else {
+		rdr = f->private_data;
+		dev = rdr->dev;
+	}
+	fput(f);
+	return dev;
+}
+
+
+/* Add the topics named below node that match the rest of a pattern.
+ * Called with fo_names_lock and sub->lock held. */
+static int fo_trie_match(struct fo_sub *sub, struct fo_tnode *node,
+			 const char *pat)
+{
+	struct fo_tnode *kid;
+	const char *rest;
+	int n, ret = 0;
+
+	n = fo_level_len(pat);
+	rest = pat[n] ? pat + n + 1 : pat + n;
+	list_for_each_entry(kid, &node->kids, sibs) {
+		if ((n == 2) && !strncmp(pat, "**", 2)) {
+			/* every topic from here down */
+			if (kid->minor >= 0)
+				ret = fo_sub_add(sub, &fo_devs[kid->minor]);
+			if (!ret)
+				ret = fo_trie_match(sub, kid, pat);
+		} else if (((n == 1) && (*pat == '*')) ||
+				(!strncmp(kid->name, pat, n) && !kid->name[n])) {
+			if (!*rest && (kid->minor >= 0))
+				ret = fo_sub_add(sub, &fo_devs[kid->minor]);
+			else if (*rest)
+				ret = fo_trie_match(sub, kid, rest);
+		}
+		if (ret)
+			break;
+	}
+	return ret;
+}
+
+
+/* Name the topic on minor mnr, and add it to the subscriptions whose
+ * patterns match the new name.  If one of them cannot take it the
+ * name stays and the error is returned. */
+static int fo_topic_name(struct fo_topic *tp)
+{
+	struct fo_tnode *node;
+	struct fo_sub *sub;
+	struct fo_pat *p;
+	struct fo *dev;
+	int ret = 0;
+
+	if ((tp->minor >= numberofdevs) || !fo_name_ok(tp->name, 0))
+		return -EINVAL;
+	dev = &fo_devs[tp->minor];
+
+	mutex_lock(&fo_names_lock);
+	if (dev->tname) {
+		ret = -EBUSY;
+		goto out;
+	}
+	node = fo_trie_find(tp->name, 1);
+	if (!node) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (node->minor >= 0) {
+		ret = -EEXIST;
+		goto out;
+	}
+	dev->tname = kstrdup(tp->name, GFP_KERNEL);
+	if (!dev->tname) {
+		fo_trie_prune(node);
+		ret = -ENOMEM;
+		goto out;
+	}
+	node->minor = tp->minor;
+
+	list_for_each_entry(sub, &fo_subs, list) {
+		mutex_lock(&sub->lock);
+		list_for_each_entry(p, &sub->pats, list) {
+			if (fo_name_match(p->pat, tp->name)) {
+				ret = fo_sub_add(sub, dev);
+				break;
+			}
+		}
+		mutex_unlock(&sub->lock);
+		if (ret)
+			break;	/* the name stands, some miss it */
+	}
+out:
+	mutex_unlock(&fo_names_lock);
+	return ret;
+}
+
+
+/* Take the name off a topic.  Subscriptions keep reading it. */
+static int fo_topic_unname(struct fo_topic *tp)
+{
+	struct fo_tnode *node;
+	int ret = 0;
+
+	mutex_lock(&fo_names_lock);
+	node = fo_trie_find(tp->name, 0);
+	if (!node || (node->minor < 0)) {
+		ret = -ENOENT;
+	} else {
+		kfree(fo_devs[node->minor].tname);
+		fo_devs[node->minor].tname = NULL;
+		node->minor = -1;
+		fo_trie_prune(node);
+	}
+	mutex_unlock(&fo_names_lock);
+	return ret;
+}
+
+
+/* Subscribe to the topics that match a pattern now or later */
+static int fo_subscribe(struct fo_sub *sub, const char *pat)
+{
+	struct fo_pat *p;
+	int ret = 0;
+
+	if (!fo_name_ok(pat, 1))
+		return -EINVAL;
+	p = kmalloc(sizeof(struct fo_pat) + strlen(pat) + 1, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+	memcpy(p->pat, pat, strlen(pat) + 1);
+
+	mutex_lock(&fo_names_lock);
+	mutex_lock(&sub->lock);
+	list_add_tail(&p->list, &sub->pats);
+	if (list_empty(&sub->list))
+		list_add_tail(&sub->list, &fo_subs);
+	if (fo_troot)
+		ret = fo_trie_match(sub, fo_troot, pat);
+	mutex_unlock(&sub->lock);
+	mutex_unlock(&fo_names_lock);
+	return ret;
+}
+
+
+/* Records are coming to dev, so the merge keys that subscriptions
+ * peeked on it may be wrong.  Called by the writer with dev->sem
+ * held, before it takes a gseq.  The atomic that takes the gseq
+ * orders this before it, see fo_sub_read(). */
+static void fo_sub_stale(struct fo *dev)
+{
+	struct fo_subt *st;
+
+	list_for_each_entry(st, &dev->subs, dnode)
+		WRITE_ONCE(st->stale, 1);
+}
+
+
+/* A record was written to dev.  Wake the subscriptions on it.
+ * Called by the writer with dev->sem held. */
+static void fo_sub_wake(struct fo *dev)
+{
+	struct fo_subt *st;
+
+	list_for_each_entry(st, &dev->subs, dnode) {
+		WRITE_ONCE(st->stale, 1);
+		WRITE_ONCE(st->sub->ready, 1);
+		wake_up_interruptible(&st->sub->wq);
+	}
+}
+
+
+/* FO_IOC_MPUBLISH:  write one record to several framed topics, each
+ * given by a file the caller has open on it for write.  It is copied
+ * in once, and the topics are locked together, in minor order, so
+ * that a reader of any of them sees the record only once all of
+ * them have it.  Every copy has the same global sequence
+ * number.  Returns the number of topics. */
+static long fo_mpublish(struct fo_mpub __user *arg)
+{
+	struct fo_mpub mp;
+	unsigned long *set;	/* the topics, by minor */
+	unsigned long *wake;	/* topics whose inq wants the record */
+	__s32 *fds;
+	loff_t start;
+	char *data;
+	struct fo *dev;
+	u64 gseq;
+	long ret = 0;
+	int i, locked = 0;
+
+	if (copy_from_user(&mp, arg, sizeof(mp)))
+		return -EFAULT;
+	if ((mp.count == 0) || (mp.count > numberofdevs) ||
+			(mp.tag >= FO_NTAGS))
+		return -EINVAL;
+	if (mp.len == 0)
+		return 0;	/* would read as end of file */
+	if (mp.len > buffersize / 4 - FO_RHDR_SIZE)
+		return -EMSGSIZE;
+
+	fds = memdup_user(u64_to_user_ptr(mp.fds),
+			mp.count * sizeof(__s32));
+	if (IS_ERR(fds))
+		return PTR_ERR(fds);
+	set = bitmap_zalloc(numberofdevs, GFP_KERNEL);
+	wake = bitmap_zalloc(numberofdevs, GFP_KERNEL);
+	data = memdup_user(u64_to_user_ptr(mp.data), mp.len);
+	if (!set || !wake) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (IS_ERR(data)) {
+		ret = PTR_ERR(data);
+		data = NULL;
+		goto out;
+	}
+	for (i = 0; i < mp.count; i++) {
+		dev = fo_fd_dev(fds[i], FMODE_WRITE);
+		if (IS_ERR(dev)) {
+			ret = PTR_ERR(dev);
+			goto out;
+		}
+		if (__test_and_set_bit(dev->minor, set)) {
+			ret = -EINVAL;	/* the same topic twice */
+			goto out;
+		}
+	}
+
+	for_each_set_bit(i, set, numberofdevs) {
+		if (down_interruptible(&fo_devs[i].sem)) {
+			ret = -ERESTARTSYS;
+			goto unlock;
+		}
+		locked++;
+		if (fo_devs[i].mode != FO_MODE_FRAMED) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+	}
+
+	for_each_set_bit(i, set, numberofdevs)
+		fo_sub_stale(&fo_devs[i]);
+	gseq = atomic64_inc_return(&fo_gseq);
+	for_each_set_bit(i, set, numberofdevs) {
+		dev = &fo_devs[i];
+		start = dev->count;
+		fo_rec_putk(dev, start, data, mp.len, 0, mp.tag, gseq);
+		if (dev->kc)
+			fo_kc_update(dev, start);
+		fo_commit(dev, FO_RHDR_SIZE + mp.len);
+		trace_fanout_write_commit(dev->minor, FO_RHDR_SIZE + mp.len,
+				dev->count);
+		if (fo_published(dev, start))
+			__set_bit(i, wake);
+	}
+	ret = mp.count;
+
+unlock:
+	for_each_set_bit(i, set, numberofdevs) {
+		if (locked-- == 0)
+			break;
+		up(&fo_devs[i].sem);
+	}
+	for_each_set_bit(i, wake, numberofdevs)
+		wake_up_interruptible(&fo_devs[i].inq);
+	if ((ret > 0) && put_user(gseq, &arg->gseq))
+		ret = -EFAULT;
+out:
+	kfree(data);
+	bitmap_free(wake);
+	bitmap_free(set);
+	kfree(fds);
+	return ret;
+}
+
+
+/* Merge key of the record with header h, see struct fo_subt */
+static u64 fo_sub_key(struct fo_rhdr *h)
+{
+	return globalseq ? h->gseq : h->ns;
+}
+
+
+/* Copy the next record of one subscribed topic to the user, after a
+ * struct fo_trec, padded to FO_TREC_ALIGN if pad is set.  Returns the
+ * bytes used, 0 if the topic has no record, or an error.  If merge
+ * is set st->key gets the merge key of the record after. */
+static ssize_t fo_sub_copy(struct fo_sub *sub, struct fo_subt *st,
+			   char __user *buff, size_t count, int pad,
+			   int merge)
+{
+	struct fo *dev = st->dev;
+	struct fo_trec tr;
+	struct fo_rhdr h;
+	size_t used, size;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (st->pos < dev->tail) {
+		sub->lost += dev->tail - st->pos;
+		st->pos = dev->tail;
+	}
+	if ((dev->mode != FO_MODE_FRAMED) || (st->pos == dev->count)) {
+		st->key = U64_MAX;
+		st->stale = 0;
+		up(&dev->sem);
+		return 0;
+	}
+	fo_ring_get(dev, &h, st->pos, FO_RHDR_SIZE);
+	used = sizeof(tr) + h.len;
+	size = pad ? ALIGN(used, FO_TREC_ALIGN) : used;
+	if (size > count) {
+		up(&dev->sem);
+		return -EMSGSIZE;
+	}
+	memset(&tr, 0, sizeof(tr));
+	tr.topic = dev->minor;
+	tr.rec.len = h.len;
+	tr.rec.flags = h.flags;
+	tr.rec.tag = h.tag;
+	tr.rec.seq = h.seq;
+	tr.rec.ns = h.ns;
+	tr.rec.gseq = h.gseq;
+	if (copy_to_user(buff, &tr, sizeof(tr)) ||
+			fo_ring_to_user(dev, buff + sizeof(tr),
+				st->pos + FO_RHDR_SIZE, h.len) ||
+			clear_user(buff + used, size - used)) {
+		up(&dev->sem);
+		return -EFAULT;
+	}
+	st->pos += FO_RHDR_SIZE + h.len;
+	if (!merge) {
+		st->stale = 1;	/* not worth a look now */
+	} else {
+		st->key = U64_MAX;
+		st->stale = 0;
+		if (st->pos != dev->count) {
+			fo_ring_get(dev, &h, st->pos, FO_RHDR_SIZE);
+			st->key = fo_sub_key(&h);
+		}
+	}
+	trace_fanout_read(dev->minor, size, st->pos, dev->count);
+	up(&dev->sem);
+	sub->bytes += size;
+	return size;
+}
+
+
+/* Set the merge key of the next record of a subscribed topic */
+static void fo_sub_peek(struct fo_subt *st)
+{
+	struct fo *dev = st->dev;
+	struct fo_rhdr h;
+
+	down(&dev->sem);
+	st->key = U64_MAX;
+	st->stale = 0;
+	if ((dev->mode == FO_MODE_FRAMED) && (st->pos != dev->count)) {
+		if (st->pos < dev->tail)
+			st->key = 0;	/* overrun, catch up first */
+		else {
+			fo_ring_get(dev, &h, st->pos, FO_RHDR_SIZE);
+			st->key = fo_sub_key(&h);
+		}
+	}
+	up(&dev->sem);
+}
+
+
+/* Copy records of the subscribed topics to the user.  One record
+ * unless FO_SF_BATCH is set, else as many as fit.  Topics with
+ * records take turns, one record each, unless FO_SF_MERGE is set,
+ * when the oldest record of any topic goes next, by gseq if
+ * globalseq is on or else by time.  Returns the bytes used, 0 if no
+ * topic has a record, or an error.  Called with sub->lock held.
+ *
+ * A gseq is taken and committed under the topic's semaphore, and
+ * the peeks take each semaphore in turn.  So every gseq up to the
+ * newest one given out before the peeks is in a topic by the time
+ * it is peeked, and merging only those never lets a smaller one turn
+ * up later.  Bigger ones wait for the next pass.  A key stays good
+ * until its topic is read or written, so only the topics read and
+ * those whose writers marked them stale are peeked again; a writer
+ * marks them before it takes its gseq, so one under the limit is
+ * never missed. */
+static ssize_t fo_sub_read(struct fo_sub *sub, char __user *buff,
+			   size_t count)
+{
+	int batch = sub->flags & FO_SF_BATCH;
+	struct fo_subt *st, *best, *last = NULL;
+	ssize_t ret, got = 0;
+	int more;
+	u64 limit;		/* highest gseq safe to merge */
+
+	if (sub->flags & FO_SF_MERGE) {
+		do {
+			limit = globalseq ? atomic64_read(&fo_gseq) : U64_MAX;
+			smp_mb();	/* read limit before any stale flag */
+			list_for_each_entry(st, &sub->topics, snode) {
+				if (READ_ONCE(st->stale))
+					fo_sub_peek(st);
+			}
+			for (;;) {
+				best = NULL;
+				list_for_each_entry(st, &sub->topics, snode) {
+					if ((st->key != U64_MAX) && (!best ||
+							(st->key < best->key)))
+						best = st;
+				}
+				if (!best || (best->key > limit))
+					break;
+				ret = fo_sub_copy(sub, best, buff + got,
+						count - got, batch, 1);
+				if (ret < 0)
+					return got ? got : ret;
+				got += ret;
+				if (ret && !batch)
+					return got;
+			}
+		} while (!got && best);
+		return got;
+	}
+
+	do {
+		more = 0;
+		list_for_each_entry(st, &sub->topics, snode) {
+			ret = fo_sub_copy(sub, st, buff + got, count - got,
+					batch, 0);
+			if (ret < 0) {
+				if (!got)
+					return ret;
+				more = 0;
+				break;
+			}
+			if (ret) {
+				got += ret;
+				last = st;
+				more = batch;
+				if (!batch)
+					break;
+			}
+		}
+	} while (more);
+
+	/* the topic read last goes to the back of the queue */
+	if (last)
+		list_move_tail(&last->snode, &sub->topics);
+	return got;
+}
+
+
+static ssize_t fo_ctl_read(struct file *filp, char __user *buff,
+			   size_t count, loff_t *offset)
+{
+	struct fo_sub *sub = filp->private_data;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&sub->lock))
+		return -ERESTARTSYS;
+	for (;;) {
+		WRITE_ONCE(sub->ready, 0);	/* writers set it from now */
+		ret = fo_sub_read(sub, buff, count);
+		if (ret)
+			break;
+		mutex_unlock(&sub->lock);
+		if (wait_event_interruptible(sub->wq, READ_ONCE(sub->ready)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&sub->lock))
+			return -ERESTARTSYS;
+	}
+	mutex_unlock(&sub->lock);
+	return ret;
+}
+
+
+static unsigned int fo_ctl_poll(struct file *filp, poll_table *ppt)
+{
+	struct fo_sub *sub = filp->private_data;
+	struct fo_subt *st;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &sub->wq, ppt);
+	mutex_lock(&sub->lock);
+	list_for_each_entry(st, &sub->topics, snode) {
+		if ((st->dev->mode == FO_MODE_FRAMED) &&
+				(READ_ONCE(st->pos) != READ_ONCE(st->dev->count))) {
+			mask = POLLIN | POLLRDNORM;
+			break;
+		}
+	}
+	mutex_unlock(&sub->lock);
+	return mask;
+}
+
+
+static long fo_ctl_ioctl(struct file *filp, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct fo_sub *sub = filp->private_data;
+	struct fo_tnode *node;
+	struct fo_topic tp;
+	struct fo_topics ts;
+	struct fo **devs;
+	__s32 *fds;
+	long ret = 0;
+	int i;
+
+	switch (cmd) {
+	case FO_IOC_NAME:
+	case FO_IOC_UNNAME:
+	case FO_IOC_LOOKUP:
+	case FO_IOC_SUBSCRIBE:
+		if (copy_from_user(&tp, (void __user *) arg, sizeof(tp)))
+			return -EFAULT;
+		tp.name[FO_NAMELEN - 1] = 0;
+		break;
+	}
+
+	switch (cmd) {
+	case FO_IOC_NAME:
+	case FO_IOC_UNNAME:
+		/* naming is for whoever may write the control device */
+		if (!(filp->f_mode & FMODE_WRITE))
+			ret = -EPERM;
+		else if (cmd == FO_IOC_NAME)
+			ret = fo_topic_name(&tp);
+		else
+			ret = fo_topic_unname(&tp);
+		break;
+
+	case FO_IOC_LOOKUP:
+		mutex_lock(&fo_names_lock);
+		node = fo_trie_find(tp.name, 0);
+		if (!node || (node->minor < 0))
+			ret = -ENOENT;
+		else
+			tp.minor = node->minor;
+		mutex_unlock(&fo_names_lock);
+		if (!ret && copy_to_user((void __user *) arg, &tp,
+				sizeof(tp)))
+			ret = -EFAULT;
+		break;
+
+	case FO_IOC_SUBSCRIBE:
+		/* reaches topics by name, whoever may open their nodes */
+		if (!capable(CAP_SYS_ADMIN))
+			ret = -EPERM;
+		else
+			ret = fo_subscribe(sub, tp.name);
+		break;
+
+	case FO_IOC_ADDTOPICS:
+		if (copy_from_user(&ts, (void __user *) arg, sizeof(ts)))
+			return -EFAULT;
+		if (ts.count > numberofdevs)
+			return -EINVAL;
+		fds = memdup_user(u64_to_user_ptr(ts.fds),
+				ts.count * sizeof(__s32));
+		if (IS_ERR(fds))
+			return PTR_ERR(fds);
+		devs = kmalloc_array(ts.count, sizeof(struct fo *),
+				GFP_KERNEL);
+		if (!devs)
+			ret = -ENOMEM;
+		for (i = 0; !ret && (i < ts.count); i++) {
+			devs[i] = fo_fd_dev(fds[i], FMODE_READ);
+			if (IS_ERR(devs[i]))
+				ret = PTR_ERR(devs[i]);
+		}
+		mutex_lock(&sub->lock);
+		for (i = 0; !ret && (i < ts.count); i++)
+			ret = fo_sub_add(sub, devs[i]);
+		mutex_unlock(&sub->lock);
+		kfree(devs);
+		kfree(fds);
+		break;
+
+	case FO_IOC_MPUBLISH:
+		if (!(filp->f_mode & FMODE_WRITE))
+			ret = -EPERM;
+		else
+			ret = fo_mpublish((struct fo_mpub __user *) arg);
+		break;
+
+	case FO_IOC_SUBFLAGS:
+		if (arg & ~FO_SF_ALL)
+			ret = -EINVAL;
+		else
+			sub->flags = arg;
+		break;
+
+	case FO_IOC_LOST:
+		ret = put_user(sub->lost, (__u64 __user *) arg);
+		break;
+
+	default:
+		ret = -ENOTTY;
+	}
+	return ret;
+}
+
+
+static int fo_ctl_release(struct inode *inode, struct file *filp)
+{
+	struct fo_sub *sub = filp->private_data;
+	struct fo_subt *st, *stmp;
+	struct fo_pat *p, *ptmp;
+
+	mutex_lock(&fo_names_lock);
+	if (!list_empty(&sub->list))
+		list_del(&sub->list);
+	mutex_unlock(&fo_names_lock);
+
+	list_for_each_entry_safe(st, stmp, &sub->topics, snode) {
+		down(&st->dev->sem);
+		list_del(&st->dnode);
+		up(&st->dev->sem);
+		kfree(st);
+	}
+	list_for_each_entry_safe(p, ptmp, &sub->pats, list)
+		kfree(p);
+	kfree(sub);
+	return 0;
+}
+
+
+static const struct file_operations fo_ctl_fops = {
+	.owner = THIS_MODULE,
+	.llseek = no_llseek,
+	.read = fo_ctl_read,
+	.poll = fo_ctl_poll,
+	.unlocked_ioctl = fo_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.release = fo_ctl_release
+};
+
+
+/* An open of the control device is a subscription with no topics
+ * yet.  It gets file operations of its own. */
+static int fo_ctl_open(struct inode *inode, struct file *filp)
+{
+	struct fo_sub *sub;
+
+	sub = kzalloc(sizeof(struct fo_sub), GFP_KERNEL);
+	if (!sub)
+		return -ENOMEM;
+	mutex_init(&sub->lock);
+	INIT_LIST_HEAD(&sub->topics);
+	INIT_LIST_HEAD(&sub->pats);
+	INIT_LIST_HEAD(&sub->list);
+	init_waitqueue_head(&sub->wq);
+	filp->private_data = sub;
+	replace_fops(filp, &fo_ctl_fops);
+	return 0;
+}
+
+
+/* A register holds one value in the first half of dev->buf.  Its
+ * version is dev->count, one more for each value written, and a
+ * reader's offset is the version it read last.  A new value is
+ * copied in to the second half of the buffer first, so the seqlock
+ * write side is just a memcpy().  Called with dev->sem held.
+ * Returns the size of the value, or 0 if it was empty. */
+static int fo_write_reg(struct fo *dev, const char __user *buff,
+			size_t count)
+{
+	char *stage = dev->buf + buffersize / 2;
+
+	if (count > fo_maxwrite(dev))
+		return -EMSGSIZE;	/* a value is never split */
+	if (count == 0)
+		return 0;		/* would read as end of file */
+	if (copy_from_user(stage, buff, count))
+		return -EFAULT;
+
+	write_seqlock(&dev->reglock);
+	memcpy(dev->buf, stage, count);
+	dev->reglen = count;
+	dev->count++;
+	write_sequnlock(&dev->reglock);
+	return count;
+}
+
+
+/* Readers of a register never take dev->sem.  They wait for a new
+ * version, copy the value out and retry if a writer changed it in
+ * the mean time, so they never see a torn value. */
+static ssize_t fo_read_reg(struct fo_reader *rdr, char __user *buff,
+			   size_t count, loff_t *offset)
+{
+	struct fo *dev = rdr->dev;
+	unsigned int seq;
+	loff_t ver;
+	int len;
+
+	if (READ_ONCE(dev->count) == *offset) {
+		trace_fanout_read_wait(dev->minor, *offset, *offset);
+		if (wait_event_interruptible(dev->inq,
+				(READ_ONCE(dev->count) != *offset)))
+			return -ERESTARTSYS;
+	}
+
+	do {
+		seq = read_seqbegin(&dev->reglock);
+		ver = dev->count;
+		len = dev->reglen;
+		if (len > count) {
+			if (read_seqretry(&dev->reglock, seq))
+				continue;
+			return -EMSGSIZE;	/* retry with a bigger buffer */
+		}
+		if (copy_to_user(buff, dev->buf, len))
+			return -EFAULT;
+	} while (read_seqretry(&dev->reglock, seq));
+
+	*offset = ver;
+	rdr->pos = ver;
+	rdr->bytes += len;
+	rdr->lastread = ktime_get_ns();
+	trace_fanout_read(dev->minor, len, ver, ver);
+	return len;
+}
+
+
+/* A striped device splits dev->buf in to stripes, each a ring of
+ * framed records with a lock for its writers.  Offsets in a stripe
+ * are unsigned long and wrap, so compare them by difference.
+ * Writers free room by moving tail before they write over it, and a
+ * reader checks tail after it copies, so it never hands on a record
+ * that changed under it.  Records are numbered across the device in
+ * commit order, unless FO_ST_ANYORDER says only the order in each
+ * stripe matters. */
+
+static void fo_stripe_get(struct fo_stripe *st, void *to,
+			  unsigned long off, int n)
+{
+	int i = off & (st->size - 1);
+	int k = min(n, st->size - i);
+
+	memcpy(to, st->buf + i, k);
+	memcpy((char *) to + k, st->buf, n - k);
+}
+
+static void fo_stripe_put(struct fo_stripe *st, unsigned long off,
+			  const void *from, int n)
+{
+	int i = off & (st->size - 1);
+	int k = min(n, st->size - i);
+
+	memcpy(st->buf + i, from, k);
+	memcpy(st->buf, (const char *) from + k, n - k);
+}
+
+static int fo_stripe_to_user(struct fo_stripe *st, char __user *to,
+			     unsigned long off, int n)
+{
+	int i = off & (st->size - 1);
+	int k = min(n, st->size - i);
+
+	if (copy_to_user(to, st->buf + i, k) ||
+			copy_to_user(to + k, st->buf, n - k))
+		return -EFAULT;
+	return 0;
+}
+
+static int fo_stripe_from_user(struct fo_stripe *st, unsigned long off,
+			       const char __user *from, int n)
+{
+	int i = off & (st->size - 1);
+	int k = min(n, st->size - i);
+
+	if (copy_from_user(st->buf + i, from, k) ||
+			copy_from_user(st->buf, from + k, n - k))
+		return -EFAULT;
+	return 0;
+}
+
+
+/* FO_IOC_STRIPES:  make the device striped, with cfg->count stripes
+ * or one per online CPU.  Called with dev->sem held. */
+static int fo_stripe_set(struct fo_reader *rdr, struct file *filp,
+			 struct fo_stripecfg *cfg)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_stripe *stripes;
+	unsigned long *spos;
+	int n = cfg->count;
+	int size, i;
+
+	if (n == 0)
+		n = min_t(int, num_online_cpus(), FO_MAXSTRIPES);
+	if ((n > FO_MAXSTRIPES) || (cfg->flags & ~FO_ST_ALL))
+		return -EINVAL;
+	size = buffersize / n;
+	if (size)
+		size = rounddown_pow_of_two(size);
+	if (size / 4 <= FO_RHDR_SIZE)
+		return -EINVAL;		/* no room for a record */
+	if ((dev->nopen != 1) || fo_grp_busy(dev))
+		return -EBUSY;
+
+	stripes = kcalloc(n, sizeof(struct fo_stripe), GFP_KERNEL);
+	spos = kcalloc(n, sizeof(unsigned long), GFP_KERNEL);
+	if (!stripes || !spos) {
+		kfree(stripes);
+		kfree(spos);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		mutex_init(&stripes[i].lock);
+		stripes[i].buf = dev->buf + i * size;
+		stripes[i].size = size;
+	}
+
+	fo_reset(rdr, filp, FO_MODE_STRIPED);
+	mutex_lock(&rdr->slock);
+	down_write(&rdr->swrite);
+	dev->stripes = stripes;
+	dev->nstripes = n;
+	dev->ssize = size;
+	dev->sflags = cfg->flags;
+	atomic64_set(&dev->sseq, 0);
+	atomic_set(&dev->swriters, 0);
+	rdr->spos = spos;
+	rdr->snext = 0;
+	rdr->stripe = -1;
+	up_write(&rdr->swrite);
+	mutex_unlock(&rdr->slock);
+	return 0;
+}
+
+
+/* Drop the stripes of a device leaving striped mode */
+static void fo_stripe_free(struct fo *dev)
+{
+	kfree(dev->stripes);
+	dev->stripes = NULL;
+	dev->nstripes = 0;
+	dev->ssize = 0;
+}
+
+
+/* Write one record to the stripe of this CPU, or of this file with
+ * FO_ST_WRITER.  Only writers that land on the same stripe wait for
+ * each other. */
+static ssize_t fo_write_stripe(struct fo_reader *rdr,
+			       const char __user *buff, size_t count)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_stripe *st;
+	struct fo_rhdr h;
+	unsigned long at;
+	int ordered;
+	ssize_t ret;
+
+	if (count == 0)
+		return 0;		/* would read as end of file */
+	if (down_read_interruptible(&rdr->swrite))
+		return -ERESTARTSYS;
+	if (!dev->stripes) {		/* the mode changed */
+		up_read(&rdr->swrite);
+		return -EINVAL;
+	}
+	if (count > fo_maxwrite(dev)) {
+		up_read(&rdr->swrite);
+		return -EMSGSIZE;	/* a record is never split */
+	}
+
+	if (dev->sflags & FO_ST_WRITER) {
+		/* threads of the file may race here, the first wins */
+		if (READ_ONCE(rdr->stripe) < 0)
+			cmpxchg(&rdr->stripe, -1, (int) ((unsigned int)
+				atomic_inc_return(&dev->swriters) %
+				dev->nstripes));
+		st = &dev->stripes[READ_ONCE(rdr->stripe)];
+	} else {
+		/* a thread that has moved CPU since shares the lock */
+		st = &dev->stripes[raw_smp_processor_id() % dev->nstripes];
+	}
+	ordered = !(dev->sflags & FO_ST_ANYORDER);
+
+	if (mutex_lock_interruptible(&st->lock)) {
+		up_read(&rdr->swrite);
+		return -ERESTARTSYS;
+	}
+	trace_fanout_write_start(dev->minor, count, st->count);
+
+	/* Free room, and say so before writing over it */
+	at = st->count;
+	while (at + FO_RHDR_SIZE + count - st->tail > st->size) {
+		fo_stripe_get(st, &h, st->tail, FO_RHDR_SIZE);
+		WRITE_ONCE(st->tail, st->tail + FO_RHDR_SIZE + h.len);
+	}
+	smp_wmb();		/* pairs with fo_stripe_check() */
+
+	if (fo_stripe_from_user(st, at + FO_RHDR_SIZE, buff, count)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	memset(&h, 0, sizeof(h));
+	h.len = count;
+	h.ns = ktime_get_ns();
+	/* no subscription reads a striped device, so there is no
+	 * fo_sub_stale() to do, see fo_gseq_take() */
+	if (globalseq)
+		h.gseq = atomic64_inc_return(&fo_gseq);
+
+	if (ordered) {
+		/* A merging reader that saw the number taken waits for
+		 * the record, so keep the gap between the two short */
+		preempt_disable();
+		WRITE_ONCE(st->pend, 1);
+		smp_mb();
+		h.seq = atomic64_inc_return(&dev->sseq) - 1;
+		WRITE_ONCE(st->pseq, h.seq);
+	} else {
+		h.seq = st->nrec;
+	}
+	st->nrec++;
+	fo_stripe_put(st, at, &h, FO_RHDR_SIZE);
+	smp_store_release(&st->count, at + FO_RHDR_SIZE + count);
+	if (ordered) {
+		smp_store_release(&st->pend, 0);
+		preempt_enable();
+	}
+	ret = count;
+	trace_fanout_write_commit(dev->minor, ret, st->count);
+
+out:
+	mutex_unlock(&st->lock);
+	up_read(&rdr->swrite);
+
+	/* wq_has_sleeper() orders count before its look at the queue */
+	if ((ret > 0) && wq_has_sleeper(&dev->inq))
+		wake_up_interruptible(&dev->inq);
+	return ret;
+}
+
+
+/* Did a writer move stripe i's tail past pos, a record this reader
+ * has just copied?  If so the copy may be torn:  skip the reader to
+ * the oldest record and return -EPIPE. */
+static int fo_stripe_check(struct fo_reader *rdr, int i, unsigned long pos)
+{
+	struct fo_stripe *st = &rdr->dev->stripes[i];
+	unsigned long tail;
+
+	smp_rmb();		/* the copy before the tail */
+	tail = READ_ONCE(st->tail);
+	if ((long) (tail - pos) <= 0)
+		return 0;
+	trace_fanout_overrun(rdr->dev->minor, pos, tail);
+	rdr->overruns++;
+	rdr->lost += tail - pos;
+	rdr->spos[i] = tail;
+	return -EPIPE;
+}
+
+
+/* Find the stripe with the record this reader gets next and copy
+ * its header to h.  In commit order that is the lowest seq of any
+ * stripe, but only below the count of numbers taken before we
+ * looked:  a record numbered after that may still be passed by
+ * one numbered earlier that is not in its stripe yet.  A writer
+ * marks its stripe pend from taking a number to publishing it, so
+ * below the limit a record missing now means its writer is in that
+ * gap, and we wait for it.  Seqs rise along a stripe, so only a
+ * stripe with nothing unread can be missing one, and not if the
+ * writer's number, pseq, is known to be past the limit.  Returns
+ * the stripe, -EAGAIN if there is nothing to read, or -EPIPE.
+ * Called with rdr->slock held. */
+static int fo_stripe_next(struct fo_reader *rdr, struct fo_rhdr *h)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_stripe *st;
+	struct fo_rhdr t;
+	unsigned long pos;
+	int ordered = !(dev->sflags & FO_ST_ANYORDER);
+	int n = dev->nstripes;
+	int i, k, ret, best, newer;
+	u64 limit = 0;
+
+again:
+	best = -1;
+	newer = 0;
+	if (ordered) {
+		limit = atomic64_read(&dev->sseq);
+		smp_mb();
+	}
+	for (k = 0; k < n; k++) {
+		i = (rdr->snext + k) % n;
+		st = &dev->stripes[i];
+		pos = rdr->spos[i];
+		if (ordered && (pos == smp_load_acquire(&st->count))) {
+			while (READ_ONCE(st->pend) &&
+					(READ_ONCE(st->pseq) < limit))
+				cpu_relax();
+			smp_rmb();
+		}
+		if (pos == smp_load_acquire(&st->count))
+			continue;
+		fo_stripe_get(st, &t, pos, FO_RHDR_SIZE);
+		ret = fo_stripe_check(rdr, i, pos);
+		if (ret)
+			return ret;
+		if (!ordered) {
+			/* the stripes take turns */
+			rdr->snext = (i + 1) % n;
+			*h = t;
+			return i;
+		}
+		if (t.seq >= limit)
+			newer = 1;
+		else if ((best < 0) || (t.seq < h->seq)) {
+			best = i;
+			*h = t;
+		}
+	}
+	if (best >= 0)
+		return best;
+	if (newer)
+		goto again;	/* all committed since we took the limit */
+	return -EAGAIN;
+}
+
+
+/* Has any stripe a record this reader has not read.  Called with
+ * rdr->slock held, so a mode change cannot free the stripes or spos
+ * under us. */
+static int fo_stripe_ready(struct fo_reader *rdr)
+{
+	struct fo *dev = rdr->dev;
+	int i;
+
+	if (!rdr->spos)
+		return 1;	/* the mode changed, let read() say so */
+	for (i = 0; i < dev->nstripes; i++) {
+		if (rdr->spos[i] != smp_load_acquire(&dev->stripes[i].count))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* The wait condition of fo_read_stripe().  The task may already be
+ * set to sleep, so it cannot wait for rdr->slock:  if another thread
+ * on the file holds it, say ready and let read() look again. */
+static int fo_stripe_wake(struct fo_reader *rdr)
+{
+	int ret = 1;
+
+	if (mutex_trylock(&rdr->slock)) {
+		ret = fo_stripe_ready(rdr);
+		mutex_unlock(&rdr->slock);
+	}
+	return ret;
+}
+
+
+/* Read the next record of a striped device, in the order
+ * fo_stripe_next() picks.  Readers wait on dev->inq. */
+static ssize_t fo_read_stripe(struct fo_reader *rdr, char __user *buff,
+			      size_t count)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_rhdr h;
+	unsigned long pos;
+	int i, hlen;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&rdr->slock))
+		return -ERESTARTSYS;
+	while (1) {
+		if (!rdr->spos) {	/* the mode changed */
+			ret = -EINVAL;
+			goto out;
+		}
+		i = fo_stripe_next(rdr, &h);
+		if (i != -EAGAIN)
+			break;
+		mutex_unlock(&rdr->slock);
+		trace_fanout_read_wait(dev->minor, 0, 0);
+		if (wait_event_interruptible(dev->inq, fo_stripe_wake(rdr)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&rdr->slock))
+			return -ERESTARTSYS;
+	}
+	if (i < 0) {
+		ret = i;
+		goto out;
+	}
+
+	pos = rdr->spos[i];
+	hlen = (rdr->flags & FO_RF_HDR) ? sizeof(struct fo_rec) : 0;
+	if (hlen + h.len > count) {
+		ret = -EMSGSIZE;	/* retry with a bigger buffer */
+		goto out;
+	}
+	if ((fo_hdr_to_user(rdr, buff, &h) < 0) ||
+			fo_stripe_to_user(&dev->stripes[i], buff + hlen,
+				pos + FO_RHDR_SIZE, h.len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	ret = fo_stripe_check(rdr, i, pos);
+	if (ret)
+		goto out;
+
+	rdr->spos[i] = pos + FO_RHDR_SIZE + h.len;
+	ret = hlen + h.len;
+	rdr->bytes += ret;
+	rdr->lastread = ktime_get_ns();
+	trace_fanout_read(dev->minor, ret, rdr->spos[i],
+			smp_load_acquire(&dev->stripes[i].count));
+out:
+	mutex_unlock(&rdr->slock);
+	return ret;
+}
+
+
+/* FO_IOC_LAG, FO_IOC_SKIP and FO_IOC_REWIND on a striped device.
+ * Lag is summed over the stripes.  Called with dev->sem held. */
+static s64 fo_stripe_move(struct fo_reader *rdr, int cmd)
+{
+	struct fo *dev = rdr->dev;
+	struct fo_stripe *st;
+	unsigned long head, tail;
+	s64 lag = 0;
+	int i;
+
+	mutex_lock(&rdr->slock);
+	for (i = 0; rdr->spos && (i < dev->nstripes); i++) {
+		st = &dev->stripes[i];
+		head = smp_load_acquire(&st->count);
+		tail = READ_ONCE(st->tail);
+		if (cmd == FO_IOC_SKIP) {
+			rdr->lost += head - rdr->spos[i];
+			rdr->spos[i] = head;
+		} else if (cmd == FO_IOC_REWIND) {
+			rdr->spos[i] = tail;
+		}
+		lag += head - rdr->spos[i];
+	}
+	mutex_unlock(&rdr->slock);
+	return lag;
+}
+
+
+/* Stamp the write that just moved dev->count.  Called with
+ * dev->sem held. */
+static void fo_commit_log(struct fo *dev)
+{
+	struct fo_commit *c;
+
+	c = &dev->clog[dev->nclog++ & (FO_CLOG_SIZE - 1)];
+	c->end = dev->count;
+	c->ns = ktime_get_ns();
+}
+
+
+/* Return the commit time of the byte at stream offset off, or zero
+ * if the write holding it has aged out of the commit log.  Called
+ * with dev->sem held. */
+static u64 fo_commit_ns(struct fo *dev, loff_t off)
+{
+	u64 first, lo, hi, mid;
+
+	/* binary search for the first commit that ends past off */
+	first = (dev->nclog > FO_CLOG_SIZE) ? dev->nclog - FO_CLOG_SIZE : 0;
+	lo = first;
+	hi = dev->nclog;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (dev->clog[mid & (FO_CLOG_SIZE - 1)].end > off)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	/* If that is the oldest one logged, off may belong to a
+	 * write that was already forgotten */
+	if (lo == dev->nclog || (lo == first && first != 0))
+		return 0;
+	return dev->clog[lo & (FO_CLOG_SIZE - 1)].ns;
+}
+
+
+/* Add one delivery latency sample for a read that returned the
+ * byte at off.  Called with dev->sem held. */
+static void fo_lat_record(struct fo *dev, loff_t off, int type)
+{
+	u64 ns = fo_commit_ns(dev, off);
+
+	if (!ns)
+		return;
+	ns = ktime_get_ns() - ns;
+	dev->lat[type][min(fls64(ns), FO_LAT_BUCKETS - 1)]++;
+}
+
+
+/* debugfs 'latency':  read to get the histograms, write to reset */
+static int fo_lat_show(struct seq_file *m, void *v)
+{
+	static const char *names[FO_LAT_NTYPES] = { "woken", "ready" };
+	struct fo *dev = m->private;
+	u64 lat[FO_LAT_NTYPES][FO_LAT_BUCKETS];
+	int t, b;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	memcpy(lat, dev->lat, sizeof(lat));
+	up(&dev->sem);
+
+	for (t = 0; t < FO_LAT_NTYPES; t++) {
+		seq_printf(m, "%s:\n", names[t]);
+		for (b = 0; b < FO_LAT_BUCKETS; b++) {
+			if (!lat[t][b])
+				continue;
+			seq_printf(m, "  %12llu ns: %llu\n",
+				b ? 1ULL << (b - 1) : 0ULL, lat[t][b]);
+		}
+	}
+	return 0;
+}
+
+static int fo_lat_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, fo_lat_show, inode->i_private);
+}
+
+static ssize_t fo_lat_write(struct file *filp, const char __user *buff,
+			size_t count, loff_t *off)
+{
+	struct fo *dev = ((struct seq_file *) filp->private_data)->private;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	memset(dev->lat, 0, sizeof(dev->lat));
+	up(&dev->sem);
+	return count;
+}
+
+static const struct file_operations fo_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = fo_lat_open,
+	.read = seq_read,
+	.write = fo_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+
+/* debugfs 'readers':  one line per open subscriber of a minor */
+static int fo_readers_show(struct seq_file *m, void *v)
+{
+	struct fo *dev = m->private;
+	struct fo_reader *rdr;
+	u64 now = ktime_get_ns();
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	seq_printf(m, "head=%lld\n", dev->count);
+	seq_printf(m, "%8s %-16s %14s %10s %14s %8s %10s %10s %12s\n",
+		"pid", "comm", "offset", "lag", "bytes", "overruns", "skipped",
+		"stale", "idle_us");
+	list_for_each_entry(rdr, &dev->readers, list) {
+		seq_printf(m, "%8d %-16s %14lld %10lld %14llu %8llu %10llu "
+			"%10llu ", rdr->pid, rdr->comm, rdr->pos,
+			dev->count - rdr->pos, rdr->bytes, rdr->overruns,
+			rdr->sampled, rdr->stale);
+		if (rdr->lastread)
+			seq_printf(m, "%12llu\n",
+				div_u64(now - rdr->lastread, NSEC_PER_USEC));
+		else
+			seq_printf(m, "%12s\n", "-");
+	}
+	up(&dev->sem);
+	return 0;
+}
+
+static int fo_readers_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, fo_readers_show, inode->i_private);
+}
+
+static const struct file_operations fo_readers_fops = {
+	.owner = THIS_MODULE,
+	.open = fo_readers_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+
+/* Create /sys/kernel/debug/fanout/<minor>/ for every minor.  debugfs
+ * errors are not fatal, the driver works the same without it. */
+static void fo_debugfs_init(void)
+{
+	char name[16];
+	int i;
+
+	fo_dbgroot = debugfs_create_dir(DEVNAME, NULL);
+	for (i = 0; i < numberofdevs; i++) {
+		snprintf(name, sizeof(name), "%d", i);
+		fo_devs[i].dbgdir = debugfs_create_dir(name, fo_dbgroot);
+		debugfs_create_file("latency", 0600, fo_devs[i].dbgdir,
+				&fo_devs[i], &fo_lat_fops);
+		debugfs_create_file("readers", 0400, fo_devs[i].dbgdir,
+				&fo_devs[i], &fo_readers_fops);
+	}
+}
+
 #ifdef DEV_MKNOD
 /* callback invoked when making the nodes */
 static char *fo_dev_devnode(struct device *dev, umode_t *mode)
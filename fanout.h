@@ -0,0 +1,414 @@
+/*
+ * fanout.h:  User interface to the fanout multiplexer
+ *
+ * Copyright (C) 2010-2021, Bob Smith, Frederic Roussel
+ * This software is released under your choice of either
+ * the GPLv2 or the 3-clause BSD license.
+ *
+ * Included by both the driver and by programs that want more than
+ * open()/read()/write()/select() on a fanout device.
+ */
+
+#ifndef _FANOUT_H
+#define _FANOUT_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define FO_IOC_MAGIC (0xF0)
+
+/* Description of a fanout device, from FO_IOC_INFO */
+struct fo_info {
+	__u32 bufsize;		/* size of the circular buffer */
+	__u32 maxwrite;		/* most bytes taken by one write() */
+	__u32 mode;		/* FO_MODE_* */
+};
+
+/* Device modes, set by FO_IOC_SETMODE.  A stream device is a plain
+ * byte stream; a write may be cut short and a read returns any
+ * number of bytes.  A framed device keeps each write() as one record
+ * and each read() returns exactly one whole record, failing with
+ * EMSGSIZE if the buffer is too small for it. */
+#define FO_MODE_STREAM	(0)
+#define FO_MODE_FRAMED	(1)
+/* A register device holds just the newest value written.  A read()
+ * returns the whole current value, once per new value, and never
+ * sees a partly written one.  poll() reports POLLIN when the value
+ * changes.  Offsets, lag and lost counts are in versions, one per
+ * value written; a new reader starts with the current value. */
+#define FO_MODE_REGISTER (2)
+/* A striped device gives each CPU, or each writing file, a ring of
+ * its own, so writers do not wait on each other; see FO_IOC_STRIPES.
+ * A read() returns one whole record as a framed one does, in the
+ * order writes were committed across all stripes, or with
+ * FO_ST_ANYORDER in each stripe's own order only, the stripes taking
+ * turns.  There is no single stream to move in:  lseek() and the
+ * offset ioctls fail, and a reader overrun in one stripe skips to
+ * that stripe's oldest record. */
+#define FO_MODE_STRIPED	(3)
+
+/* Offsets are absolute positions in the stream of bytes ever written
+ * to the device, framing included.  lseek() and pread() accept any
+ * offset still in the buffer, on a record boundary if framed:
+ *   SEEK_SET, SEEK_CUR  absolute or relative offset
+ *   SEEK_END            relative to the newest byte
+ *   SEEK_DATA           oldest data at or after the offset
+ *   SEEK_HOLE           the newest byte, where the next write goes
+ * A pread() at another offset than the file's reads just what is
+ * there:  it skips no records, does not wait (EAGAIN at the newest
+ * byte), and leaves the file's position, counters and sampling as
+ * they were, so several threads can pread one file at once. */
+
+/* With FO_RF_HDR set, each read() of a framed device returns this
+ * header followed by the record */
+struct fo_rec {
+	__u32 len;		/* bytes of record after this header */
+	__u16 flags;		/* FO_REC_* */
+	__u8 tag;		/* from the publisher, see FO_IOC_SETTAG */
+	__u8 pad;
+	__u64 seq;		/* record number in this device, from 0,
+				 * or in its stripe if FO_ST_ANYORDER */
+	__u64 ns;		/* CLOCK_MONOTONIC time it was written */
+	__u64 gseq;		/* global sequence number, or 0 */
+};
+/* With the globalseq module parameter set, every framed or striped
+ * record gets a gseq when it is committed.  It counts up across all
+ * devices in commit order, so records of different devices can be
+ * put in the order they were published.  Numbers may be skipped.
+ * Otherwise only FO_IOC_MPUBLISH records have one. */
+
+#define FO_REC_SYNC	(0x0001)	/* a sync point, see FO_IOC_SYNCPOINT */
+#define FO_REC_SNAP	(0x0002)	/* from a keyed cache snapshot */
+#define FO_REC_CONFL	(0x0004)	/* newest of its key, see
+					 * FO_IOC_CONFLATE */
+#define FO_REC_PRIO	(0x0008)	/* urgent, see FO_IOC_URGENT */
+
+/* Reader flags for FO_IOC_SETFLAGS */
+#define FO_RF_HDR	(0x0001)	/* prefix records with struct fo_rec */
+#define FO_RF_SYNC	(0x0002)	/* after an overrun, resume at the
+					 * newest sync point, not the head */
+#define FO_RF_ALL	(0x0003)
+
+/* Keyed last value cache of a framed device, for FO_IOC_SETKEY.
+ * The key of a record is its first keylen bytes, at most 64. */
+struct fo_keycfg {
+	__u32 keylen;		/* 0 turns the cache off */
+	__u32 maxbytes;		/* drop least recently updated keys
+				 * when the memory the cache holds,
+				 * per-entry overhead included, exceeds
+				 * this */
+};
+
+/* Sampling of a framed device, for FO_IOC_SAMPLE.  Records the
+ * reader does not want are skipped in the kernel without a copy. */
+struct fo_sample {
+	__u64 interval;		/* ns of publish time between records */
+	__u32 every;		/* give only every Nth record */
+	__u32 pad;
+};
+
+/* Counters of one open file, from FO_IOC_STATS.  New counters take
+ * the place of reserved ones, so the size and the ioctl number stay
+ * the same; size says how many bytes this kernel filled in. */
+struct fo_stats {
+	__u32 size;		/* bytes filled in, from the start */
+	__u32 pad;
+	__u64 bytes;		/* bytes read */
+	__u64 overruns;		/* reads that failed with EPIPE */
+	__u64 lost;		/* bytes skipped by overrun or resync */
+	__u64 sampled;		/* records skipped by sampling */
+	__u64 stale;		/* records skipped as older than max age */
+	__u64 ulost;		/* urgent records overwritten unread */
+	__u64 filtered;		/* records skipped by filter or tag mask */
+	__u64 reserved[8];	/* zero, for counters to come */
+};
+
+/* Consumer group to join, for FO_IOC_JOIN */
+#define FO_GROUPNAME	(32)
+struct fo_groupcfg {
+	char name[FO_GROUPNAME];	/* empty leaves the current group */
+	__u32 keylen;		/* 0 for round robin, else the bytes of
+				 * key at the start of a record to hash */
+	__u32 pad;
+};
+
+/* A classic BPF program for FO_IOC_SETFILTER, as for SO_ATTACH_FILTER */
+struct fo_filter {
+	__u32 len;		/* instructions, 0 removes the filter */
+	__u32 pad;
+	__u64 insns;		/* user address of struct sock_filter[len] */
+};
+
+/* What a filter program sees of each record.  It may load only
+ * 32-bit words, in host byte order, with BPF_LD|BPF_W|BPF_ABS at a
+ * multiple of 4; BPF_LEN is the size of this struct.  data holds the
+ * start of the record, zero filled past its end. */
+#define FO_FILTWIN	(64)
+struct fo_filtctx {
+	__u32 len;		/* as in struct fo_rec */
+	__u16 flags;
+	__u8 tag;
+	__u8 pad;
+	__u64 seq;
+	__u64 ns;
+	__u8 data[FO_FILTWIN];	/* first bytes of the record */
+};
+
+/* Record tags a reader wants, for FO_IOC_SETMASK.  All ones, the
+ * default, is every record. */
+#define FO_NTAGS	(256)
+struct fo_tagmask {
+	__u64 bits[FO_NTAGS / 64];
+};
+#define FO_TAG_SET(bits, t)	((bits)[(t) / 64] |= 1ULL << ((t) % 64))
+#define FO_TAG_ISSET(bits, t)	(((bits)[(t) / 64] >> ((t) % 64)) & 1)
+
+/* A topic name for the control device, /dev/fanoutctl.  Names are
+ * levels separated by /, like md/equities/XNYS.  A subscription
+ * pattern may also have * for any one level and a final ** for one
+ * or more levels. */
+#define FO_NAMELEN	(128)
+struct fo_topic {
+	char name[FO_NAMELEN];	/* name or pattern, nul terminated */
+	__u32 minor;		/* the topic's fanout minor number */
+	__u32 pad;
+};
+
+/* A read() of the control device returns one record from one of its
+ * subscribed framed topics, after this header.  With FO_SF_BATCH it
+ * returns as many records as fit, each padded to FO_TREC_ALIGN. */
+struct fo_trec {
+	__u32 topic;		/* minor number of the topic */
+	__u32 pad;
+	struct fo_rec rec;	/* as for FO_RF_HDR on the topic */
+};
+#define FO_TREC_ALIGN	(8)
+
+/* Topics to add to a control device subscription, for
+ * FO_IOC_ADDTOPICS.  Each is given by a file descriptor the caller
+ * has it open on for read. */
+struct fo_topics {
+	__u32 count;		/* number of descriptors */
+	__u32 pad;
+	__u64 fds;		/* user address of __s32[count] */
+};
+
+/* One record for several topics, for FO_IOC_MPUBLISH */
+struct fo_mpub {
+	__u64 data;		/* user address of the record */
+	__u64 fds;		/* user address of __s32[count], each
+				 * a topic open for write */
+	__u32 len;		/* record length */
+	__u32 count;		/* number of topics */
+	__u32 tag;		/* record tag, 0 to 255 */
+	__u32 pad;
+	__u64 gseq;		/* out: its global sequence number */
+};
+
+/* Layout of a striped device, for FO_IOC_STRIPES */
+struct fo_stripecfg {
+	__u32 count;		/* stripes, 0 for one per online CPU */
+	__u32 flags;		/* FO_ST_* */
+};
+#define FO_MAXSTRIPES	(64)
+
+#define FO_ST_WRITER	(0x0001)	/* a stripe per writing file,
+					 * else per CPU */
+#define FO_ST_ANYORDER	(0x0002)	/* keep only the order within a
+					 * stripe, so per writer with
+					 * FO_ST_WRITER */
+#define FO_ST_ALL	(0x0003)
+
+/* Subscription flags for FO_IOC_SUBFLAGS */
+#define FO_SF_BATCH	(0x0001)	/* read fills the buffer */
+#define FO_SF_MERGE	(0x0002)	/* oldest record of any topic first,
+					 * by gseq with globalseq set, else
+					 * topics take turns */
+#define FO_SF_ALL	(0x0003)
+
+/* One record returned by FO_IOC_RECVMMSG.  Its data is at off in
+ * the payload buffer. */
+struct fo_mdesc {
+	__u32 off;		/* byte offset in fo_mrecv.buf */
+	__u32 pad;
+	struct fo_rec rec;	/* len, flags, tag, seq and ns */
+};
+
+/* Many records in one call, for FO_IOC_RECVMMSG */
+struct fo_mrecv {
+	__u64 descs;		/* user address of struct fo_mdesc[vlen] */
+	__u64 buf;		/* user address of the payload buffer */
+	__u64 buflen;		/* size of the payload buffer */
+	__u64 timeout;		/* most ns to wait for min records, 0 is
+				 * no limit */
+	__u32 vlen;		/* room in descs */
+	__u32 min;		/* wait for this many records, 0 is 1 */
+};
+
+/* One record for FO_IOC_SENDMMSG */
+struct fo_mmsg {
+	__u64 data;		/* user address of the record */
+	__u32 len;		/* its length */
+	__u16 flags;		/* FO_MF_* */
+	__u8 tag;		/* its tag, with FO_MF_TAG */
+	__u8 pad;
+	__s32 result;		/* out: len if written, else -errno */
+	__u32 pad2;
+};
+#define FO_MF_TAG	(0x0001)	/* tag, not the file's FO_IOC_SETTAG */
+
+/* Many records in one call, for FO_IOC_SENDMMSG */
+struct fo_msend {
+	__u64 msgs;		/* user address of struct fo_mmsg[vlen] */
+	__u32 vlen;		/* at most FO_MMSG_MAX */
+	__u32 pad;
+};
+#define FO_MMSG_MAX	(1024)
+
+/* Where FO_IOC_REPLAY puts the reader */
+struct fo_replay {
+	__u32 from;		/* FO_REPLAY_* */
+	__u32 pad;
+	__u64 n;		/* bytes or records back from the newest */
+};
+#define FO_REPLAY_OLDEST	(0)	/* oldest data still buffered */
+#define FO_REPLAY_BYTES		(1)	/* n bytes back, or oldest */
+#define FO_REPLAY_RECORDS	(2)	/* n records back, framed only */
+#define FO_REPLAY_SYNC		(3)	/* newest sync point, or ENOENT */
+
+/* Reader control.  FIONREAD is also supported and gives the number
+ * of bytes a read() could return now, or fails with EPIPE if the
+ * reader has been overrun. */
+/* bytes between this reader and the newest byte written */
+#define FO_IOC_LAG	_IOR(FO_IOC_MAGIC, 1, __s64)
+/* total bytes this reader skipped, by overrun or by resync */
+#define FO_IOC_LOST	_IOR(FO_IOC_MAGIC, 2, __u64)
+/* move the reader to the newest byte, skipping all pending data */
+#define FO_IOC_SKIP	_IO(FO_IOC_MAGIC, 3)
+/* move the reader to the oldest byte still in the buffer */
+#define FO_IOC_REWIND	_IO(FO_IOC_MAGIC, 4)
+/* get the buffer size and maximum write size */
+#define FO_IOC_INFO	_IOR(FO_IOC_MAGIC, 5, struct fo_info)
+/* set the device mode, arg is FO_MODE_*.  Fails with EBUSY unless
+ * the caller is the only one with the device open.  The buffered
+ * data is discarded. */
+#define FO_IOC_SETMODE	_IO(FO_IOC_MAGIC, 6)
+/* position the reader on retained data, usually right after open */
+#define FO_IOC_REPLAY	_IOW(FO_IOC_MAGIC, 7, struct fo_replay)
+/* framed only: move to the record with this sequence number, or
+ * the head if it is not written yet.  ENOENT if it is already gone */
+#define FO_IOC_SEEK_SEQ	_IOW(FO_IOC_MAGIC, 8, __u64)
+/* framed only: move to the first record written at or after this
+ * CLOCK_MONOTONIC time in ns */
+#define FO_IOC_SEEK_TIME _IOW(FO_IOC_MAGIC, 9, __u64)
+/* set reader flags, arg is FO_RF_* */
+#define FO_IOC_SETFLAGS	_IO(FO_IOC_MAGIC, 10)
+/* the next write() on this file is a sync point, for example a full
+ * snapshot in a delta encoded feed.  Readers can start or resume at
+ * the newest sync point still buffered. */
+#define FO_IOC_SYNCPOINT _IO(FO_IOC_MAGIC, 11)
+/* framed, writers only:  keep the newest record of every key */
+#define FO_IOC_SETKEY	_IOW(FO_IOC_MAGIC, 12, struct fo_keycfg)
+/* move the reader to the head and queue the newest record of every
+ * cached key in front of the live records, with no gap between them.
+ * Snapshot records have FO_REC_SNAP set in their header. */
+#define FO_IOC_SNAPSHOT	_IO(FO_IOC_MAGIC, 13)
+/* keyed devices:  when this reader falls more than arg bytes behind,
+ * or is overrun, it gets only the newest record of each key that
+ * changed since its position, flagged FO_REC_CONFL, and then carries
+ * on from the head.  Records too short to have a key are skipped.
+ * 0 turns conflation off. */
+#define FO_IOC_CONFLATE	_IO(FO_IOC_MAGIC, 14)
+/* framed:  sample records, all zero turns sampling off */
+#define FO_IOC_SAMPLE	_IOW(FO_IOC_MAGIC, 15, struct fo_sample)
+/* get the counters of this open file */
+#define FO_IOC_STATS	_IOR(FO_IOC_MAGIC, 16, struct fo_stats)
+/* framed:  skip records published more than this many ns ago, 0 is off */
+#define FO_IOC_MAXAGE	_IOW(FO_IOC_MAGIC, 17, __u64)
+/* framed:  the next write() on this file is urgent.  Urgent records,
+ * at most 256 bytes, go in a small lane of their own that every
+ * reader drains before the rest of the device; poll() reports
+ * POLLPRI while one is waiting.  Only the newest 16 are kept.  The
+ * seq of an urgent record counts urgent records only. */
+#define FO_IOC_URGENT	_IO(FO_IOC_MAGIC, 18)
+/* framed readers:  join a consumer group.  The members of a group
+ * share one cursor and each record at it is read by just one of
+ * them, the next idle member or the member the key hashes to.  A new
+ * group starts at the head; a group outlives its members until the
+ * device mode changes, at most 16 per device.  Group members do not
+ * get urgent records, snapshots, sampling or conflation, and LAG
+ * and LOST are those of the group. */
+#define FO_IOC_JOIN	_IOW(FO_IOC_MAGIC, 19, struct fo_groupcfg)
+/* framed readers:  read only the records for which the filter
+ * returns non-zero.  Others are skipped without a copy and neither
+ * wake the reader nor make it ready for poll().  Urgent and snapshot
+ * records are not filtered, and group members ignore the filter. */
+#define FO_IOC_SETFILTER _IOW(FO_IOC_MAGIC, 20, struct fo_filter)
+/* framed writers:  tag the records this file writes from now on,
+ * arg is 0 to 255 */
+#define FO_IOC_SETTAG	_IO(FO_IOC_MAGIC, 21)
+/* framed readers:  read only records whose tag is in the mask.  A
+ * record no sleeping reader wants wakes nobody.  Like the filter,
+ * the mask does not apply to urgent or snapshot records, or to group
+ * members. */
+#define FO_IOC_SETMASK	_IOW(FO_IOC_MAGIC, 22, struct fo_tagmask)
+
+/* Control device.  Each open file of it is a subscription to any
+ * number of topics, read through that one file; FO_IOC_LOST gives
+ * the bytes it lost to overruns in all of them.  New topics reached
+ * by a subscription are read from their head.  A subscription reads
+ * a topic without opening its node, so it needs either an open file
+ * of the topic (FO_IOC_ADDTOPICS) or CAP_SYS_ADMIN (FO_IOC_SUBSCRIBE). */
+/* name the topic on a minor, needs the control device open for write */
+#define FO_IOC_NAME	_IOW(FO_IOC_MAGIC, 23, struct fo_topic)
+/* take a name off its topic, needs write */
+#define FO_IOC_UNNAME	_IOW(FO_IOC_MAGIC, 24, struct fo_topic)
+/* find the minor number of a named topic, or ENOENT */
+#define FO_IOC_LOOKUP	_IOWR(FO_IOC_MAGIC, 25, struct fo_topic)
+/* subscribe to the topics a name or pattern matches, now and as
+ * they are named later, needs CAP_SYS_ADMIN */
+#define FO_IOC_SUBSCRIBE _IOW(FO_IOC_MAGIC, 26, struct fo_topic)
+/* subscribe to a set of topics by open file descriptor, named or
+ * not */
+#define FO_IOC_ADDTOPICS _IOW(FO_IOC_MAGIC, 27, struct fo_topics)
+/* set subscription flags, arg is FO_SF_* */
+#define FO_IOC_SUBFLAGS	_IO(FO_IOC_MAGIC, 28)
+/* publish one record to a set of framed topics by open file
+ * descriptor, needs write.  Readers of any of them see it only once
+ * all have it, and every copy has the same gseq, counted across the
+ * whole module.  Returns the number of topics. */
+#define FO_IOC_MPUBLISH	_IOWR(FO_IOC_MAGIC, 34, struct fo_mpub)
+
+/* Batched I/O on framed devices */
+/* read as many whole records as fit in the descriptors and payload
+ * buffer, under one lock, and return how many.  It waits for min
+ * records or the timeout, whichever is first, and returns fewer if
+ * the buffer fills or a signal comes after some were read; 0 means
+ * the timeout passed with none.  EMSGSIZE if the next record does
+ * not fit the empty buffer.  Not for group members. */
+#define FO_IOC_RECVMMSG	_IOW(FO_IOC_MAGIC, 29, struct fo_mrecv)
+/* writers:  write the records in order under one lock, commit them
+ * together and wake the readers once.  A batch holds at most half
+ * the buffer, headers included.  Writing stops at the
+ * first record that fails, with ENOBUFS if the batch is full; each
+ * record's result says what became of it.  Returns how many were
+ * written, or the first record's error.  A sync point set with
+ * FO_IOC_SYNCPOINT is the first record. */
+#define FO_IOC_SENDMMSG	_IOW(FO_IOC_MAGIC, 30, struct fo_msend)
+/* writers:  start a transaction.  The records this file writes from
+ * now on are held back, at most half the buffer of them, and write()
+ * fails with ENOBUFS when that is full. */
+#define FO_IOC_TXBEGIN	_IO(FO_IOC_MAGIC, 31)
+/* publish the transaction's records together, so that readers see
+ * all of them or none.  Returns how many there were. */
+#define FO_IOC_TXCOMMIT	_IO(FO_IOC_MAGIC, 32)
+/* drop the transaction's records; closing the file does too */
+#define FO_IOC_TXABORT	_IO(FO_IOC_MAGIC, 33)
+
+/* make the device striped, see FO_MODE_STRIPED.  Like FO_IOC_SETMODE
+ * it needs the sole open file and discards the buffer.  Each stripe
+ * gets an equal share of the buffer, rounded down to a power of two;
+ * EINVAL if that is too small to hold records. */
+#define FO_IOC_STRIPES	_IOW(FO_IOC_MAGIC, 35, struct fo_stripecfg)
+
+#endif /* _FANOUT_H */
@@ -0,0 +1,165 @@
+/*
+ * fanout_trace.h:  Tracepoints for the fanout multiplexer
+ *
+ * Copyright (C) 2010-2021, Bob Smith, Frederic Roussel
+ * This software is released under your choice of either
+ * the GPLv2 or the 3-clause BSD license.
+ *
+ * These replace the debuglevel printk's on the read, write and
+ * poll paths.  A disabled tracepoint is a patched-out static
+ * branch, so the hot paths pay nothing unless someone is looking.
+ * Enable with, for example:
+ *     echo 1 > /sys/kernel/tracing/events/fanout/enable
+ *     perf record -e 'fanout:*' -a
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fanout
+
+#if !defined(_FANOUT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FANOUT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A writer is about to copy count bytes in at stream offset head */
+TRACE_EVENT(fanout_write_start,
+
+	TP_PROTO(int minor, size_t count, loff_t head),
+
+	TP_ARGS(minor, count, head),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, count)
+		__field(loff_t, head)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->head = head;
+	),
+
+	TP_printk("minor=%d count=%zu head=%lld",
+		__entry->minor, __entry->count, __entry->head)
+);
+
+/* A writer made bytes visible to readers, head is the new count */
+TRACE_EVENT(fanout_write_commit,
+
+	TP_PROTO(int minor, int bytes, loff_t head),
+
+	TP_ARGS(minor, bytes, head),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, bytes)
+		__field(loff_t, head)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->bytes = bytes;
+		__entry->head = head;
+	),
+
+	TP_printk("minor=%d bytes=%d head=%lld",
+		__entry->minor, __entry->bytes, __entry->head)
+);
+
+/* A reader got bytes, off is its position after the copy */
+TRACE_EVENT(fanout_read,
+
+	TP_PROTO(int minor, ssize_t bytes, loff_t off, loff_t head),
+
+	TP_ARGS(minor, bytes, off, head),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(ssize_t, bytes)
+		__field(loff_t, off)
+		__field(loff_t, lag)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->bytes = bytes;
+		__entry->off = off;
+		__entry->lag = head - off;
+	),
+
+	TP_printk("minor=%d bytes=%zd off=%lld lag=%lld",
+		__entry->minor, __entry->bytes, __entry->off, __entry->lag)
+);
+
+/* Reader position events:  going to sleep, waking up, overrun */
+DECLARE_EVENT_CLASS(fanout_pos,
+
+	TP_PROTO(int minor, loff_t off, loff_t head),
+
+	TP_ARGS(minor, off, head),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(loff_t, off)
+		__field(loff_t, lag)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->off = off;
+		__entry->lag = head - off;
+	),
+
+	TP_printk("minor=%d off=%lld lag=%lld",
+		__entry->minor, __entry->off, __entry->lag)
+);
+
+DEFINE_EVENT(fanout_pos, fanout_read_wait,
+	TP_PROTO(int minor, loff_t off, loff_t head),
+	TP_ARGS(minor, off, head)
+);
+
+DEFINE_EVENT(fanout_pos, fanout_read_wake,
+	TP_PROTO(int minor, loff_t off, loff_t head),
+	TP_ARGS(minor, off, head)
+);
+
+DEFINE_EVENT(fanout_pos, fanout_overrun,
+	TP_PROTO(int minor, loff_t off, loff_t head),
+	TP_ARGS(minor, off, head)
+);
+
+/* poll() result for a reader at off */
+TRACE_EVENT(fanout_poll,
+
+	TP_PROTO(int minor, loff_t off, loff_t head, unsigned int mask),
+
+	TP_ARGS(minor, off, head, mask),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(loff_t, off)
+		__field(loff_t, lag)
+		__field(unsigned int, mask)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->off = off;
+		__entry->lag = head - off;
+		__entry->mask = mask;
+	),
+
+	TP_printk("minor=%d off=%lld lag=%lld mask=0x%x",
+		__entry->minor, __entry->off, __entry->lag, __entry->mask)
+);
+
+#endif /* _FANOUT_TRACE_H */
+
+/* This part must be outside the multi-read protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fanout_trace
+#include <trace/define_trace.h>